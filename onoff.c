@@ -45,10 +45,18 @@ typedef struct {
     uint8_t dir_port;
 } onoff_spindle_settings_t;
 
+// Stored in a separate NVS block so that the port settings are kept when upgrading.
+typedef struct {
+    uint16_t ramp_time; // ms, 0 to disable
+} onoff_ramp_settings_t;
+
 static onoff_spindle_settings_t spindle_config, run;
+static onoff_ramp_settings_t ramp_config;
+static uint16_t ramp_time;
 static spindle_state_t spindle_state = {0};
 static io_port_cfg_t d_out;
-static nvs_address_t nvs_address;
+static nvs_address_t nvs_address, ramp_nvs_address;
+static spindle_ramp_t ramp; // timing only, at speed is reported when the ramp ends
 
 // Start or stop spindle
 static void spindleSetState (spindle_ptrs_t *spindle, spindle_state_t state, float rpm)
@@ -62,14 +70,29 @@ static void spindleSetState (spindle_ptrs_t *spindle, spindle_state_t state, flo
         ioport_digital_out(run.dir_port, state.ccw);
 #endif
     ioport_digital_out(run.on_port, state.on);
+    spindle_ramp_set(&ramp, state.on ? 1.0f : 0.0f);
 }
 
 // Returns spindle state in a spindle_state_t variable
 static spindle_state_t spindleGetState (spindle_ptrs_t *spindle)
 {
+    spindle_state_t state = spindle_state;
+
     UNUSED(spindle);
 
-    return spindle_state;
+    state.at_speed = state.on && spindle_ramp_at_target(&ramp);
+
+    return state;
+}
+
+static bool spindleConfig (spindle_ptrs_t *spindle)
+{
+    if(spindle == NULL)
+        return false;
+
+    spindle->cap.at_speed = ramp_time > 0;
+
+    return true;
 }
 
 static void onoff_spindle_register (void)
@@ -80,6 +103,7 @@ static void onoff_spindle_register (void)
         .cap = {
             .gpio_controlled = On
         },
+        .config = spindleConfig,
         .set_state = spindleSetState,
         .get_state = spindleGetState
     };
@@ -91,6 +115,7 @@ static void onoff_spindle_register (void)
             .direction = On,
             .gpio_controlled = On
         },
+        .config = spindleConfig,
         .set_state = spindleSetState,
         .get_state = spindleGetState
     };
@@ -146,20 +171,30 @@ static float get_port (setting_id_t setting)
 PROGMEM static const setting_detail_t vfd_settings[] = {
     { Setting_Spindle_OnPort, Group_AuxPorts, "Spindle on port", NULL, Format_Decimal, "-#0", "-1", d_out.port_maxs, Setting_NonCoreFn, set_port, get_port, NULL, { .reboot_required = On } },
 #if ON_OFF_N_PORTS == 2
-    { Setting_Spindle_DirPort, Group_AuxPorts, "Spindle dir port", NULL, Format_Decimal, "-#0", "-1", d_out.port_maxs, Setting_NonCoreFn, set_port, get_port, NULL, { .reboot_required = On } }
+    { Setting_Spindle_DirPort, Group_AuxPorts, "Spindle dir port", NULL, Format_Decimal, "-#0", "-1", d_out.port_maxs, Setting_NonCoreFn, set_port, get_port, NULL, { .reboot_required = On } },
 #endif
+    { Setting_OnOffSpindle_RampTime, Group_Spindle, "Spindle spin up time", "ms", Format_Int16, "####0", "0", "65535", Setting_NonCore, &ramp_config.ramp_time, NULL, NULL, { .reboot_required = On } }
 };
 
 PROGMEM static const setting_descr_t spindle_settings_descr[] = {
     { Setting_Spindle_OnPort, "On/off spindle on/off port. Set to -1 to disable." },
 #if ON_OFF_N_PORTS == 2
-    { Setting_Spindle_DirPort, "On/off spindle direction port. Set to -1 to disable." }
+    { Setting_Spindle_DirPort, "On/off spindle direction port. Set to -1 to disable." },
 #endif
+    { Setting_OnOffSpindle_RampTime, "On/off spindle time from on to at speed, at speed is reported when it has elapsed. Set to 0 to disable." }
 };
 
 static void spindle_settings_save (void)
 {
     hal.nvs.memcpy_to_nvs(nvs_address, (uint8_t *)&spindle_config, sizeof(onoff_spindle_settings_t), true);
+    hal.nvs.memcpy_to_nvs(ramp_nvs_address, (uint8_t *)&ramp_config, sizeof(onoff_ramp_settings_t), true);
+}
+
+static void ramp_settings_restore (void)
+{
+    ramp_config.ramp_time = 0;
+
+    hal.nvs.memcpy_to_nvs(ramp_nvs_address, (uint8_t *)&ramp_config, sizeof(onoff_ramp_settings_t), true);
 }
 
 static void spindle_settings_restore (void)
@@ -171,8 +206,9 @@ static void spindle_settings_restore (void)
     spindle_config.dir_port = IOPORT_UNASSIGNED;
 #endif
 
-
     hal.nvs.memcpy_to_nvs(nvs_address, (uint8_t *)&spindle_config, sizeof(onoff_spindle_settings_t), true);
+
+    ramp_settings_restore();
 }
 
 static void spindle_settings_load (void)
@@ -182,12 +218,18 @@ static void spindle_settings_load (void)
     if((hal.nvs.memcpy_from_nvs((uint8_t *)&spindle_config, nvs_address, sizeof(onoff_spindle_settings_t), true) != NVS_TransferResult_OK))
         spindle_settings_restore();
 
+    if((hal.nvs.memcpy_from_nvs((uint8_t *)&ramp_config, ramp_nvs_address, sizeof(onoff_ramp_settings_t), true) != NVS_TransferResult_OK))
+        ramp_settings_restore();
+
     run.on_port = spindle_config.on_port;
 #if ON_OFF_N_PORTS == 2
     run.dir_port = spindle_config.dir_port;
 #else
     run.dir_port = IOPORT_UNASSIGNED;
 #endif
+    ramp_time = ramp_config.ramp_time;
+
+    spindle_ramp_configure(&ramp, 1.0f, ramp_time);
 
     ok = !!d_out.claim(&d_out, &run.on_port, "Spindle on", (pin_cap_t){});
 #if ON_OFF_N_PORTS == 2
@@ -212,8 +254,11 @@ void onoff_spindle_init (void)
     };
 
     if(ioports_cfg(&d_out, Port_Digital, Port_Output)->n_ports >= ON_OFF_N_PORTS &&
-       (nvs_address = nvs_alloc(sizeof(onoff_spindle_settings_t))))
+       (nvs_address = nvs_alloc(sizeof(onoff_spindle_settings_t))) &&
+        (ramp_nvs_address = nvs_alloc(sizeof(onoff_ramp_settings_t)))) {
+        spindle_ramp_register(&ramp, NULL);
         settings_register(&vfd_setting_details);
+    }
     else
         task_run_on_startup(report_warning, "On/off spindle failed to initialize!");
 }
@@ -1,8 +1,6 @@
 /*
   pwm.c - additional PWM spindle.
 
-  NOTE: this spindle is not capable of driving a laser mode spindle.
-
   Part of grblHAL
 
   Copyright (c) 2023-2026 Terje Io
@@ -30,11 +28,137 @@
 #include "grbl/protocol.h"
 #include "grbl/nvs_buffer.h"
 
+#define PWM2_LUT_POINTS 4   // number of calibration points, one setting each
+#define PWM2_RESOLUTION 10000 // PWM values are in 1/100 percent
+
+#ifndef PWM2_LUT_SIZE
+#define PWM2_LUT_SIZE 128   // number of table entries between min and max RPM
+#endif
+
+typedef struct {
+    float rpm;
+    float pwm;  // percent
+} pwm_point_t;
+
+typedef struct {
+    pwm_point_t point[PWM2_LUT_POINTS];
+    uint16_t ramp_time; // ms from 0 to max RPM, 0 to disable
+} pwm2_settings_t;
+
+static struct {
+    bool enabled;
+    float rpm_min;
+    float scale;                    // table entries per RPM
+    uint16_t duty[PWM2_LUT_SIZE];   // 1/100 percent
+} lut = {0};
+
 static uint8_t port_pwm = 0, port_on = 0, port_dir = IOPORT_UNASSIGNED;
 static xbar_t pwm_port;
 static spindle_id_t spindle_id = -1;
 static spindle1_pwm_settings_t *spindle_config;
 static spindle_state_t spindle_state = {0};
+static nvs_address_t nvs_address;
+static pwm2_settings_t plugin_settings;
+static spindle_ramp_t ramp;
+static spindle_pwm_t pwm_data;
+static float pwm_scale = 0.01f; // PWM value to percent
+static machine_mode_t mode;
+static settings_changed_ptr settings_changed;
+
+/*
+  Piecewise linear RPM to PWM mapping.
+
+  The calibration points between min and max RPM, together with the min and max PWM settings at the end points,
+  are interpolated into a table with equally spaced entries on settings changes. A lookup is then a multiply and
+  a linear interpolation between two entries.
+*/
+
+static void lut_build (spindle_settings_t *cfg)
+{
+    uint_fast8_t idx, seg = 0, n_points = 1;
+    pwm_point_t point[PWM2_LUT_POINTS + 2], tmp;
+
+    point[0].rpm = cfg->rpm_min;
+    point[0].pwm = cfg->pwm_min_value;
+
+    for(idx = 0; idx < PWM2_LUT_POINTS; idx++) {
+        if(plugin_settings.point[idx].rpm > cfg->rpm_min && plugin_settings.point[idx].rpm < cfg->rpm_max)
+            memcpy(&point[n_points++], &plugin_settings.point[idx], sizeof(pwm_point_t));
+    }
+
+    // Sort on RPM, few points so insertion sort.
+    for(idx = 2; idx < n_points; idx++) {
+        for(seg = idx; seg > 1 && point[seg - 1].rpm > point[seg].rpm; seg--) {
+            memcpy(&tmp, &point[seg], sizeof(pwm_point_t));
+            memcpy(&point[seg], &point[seg - 1], sizeof(pwm_point_t));
+            memcpy(&point[seg - 1], &tmp, sizeof(pwm_point_t));
+        }
+    }
+
+    point[n_points].rpm = cfg->rpm_max;
+    point[n_points++].pwm = cfg->pwm_max_value;
+
+    if(!(lut.enabled = n_points > 2 && cfg->rpm_max > cfg->rpm_min))
+        return;
+
+    lut.rpm_min = cfg->rpm_min;
+    lut.scale = (float)(PWM2_LUT_SIZE - 1) / (cfg->rpm_max - cfg->rpm_min);
+
+    for(idx = seg = 0; idx < PWM2_LUT_SIZE; idx++) {
+
+        float rpm = cfg->rpm_min + (float)idx / lut.scale;
+
+        while(seg < n_points - 2 && rpm >= point[seg + 1].rpm)
+            seg++;
+
+        // Duplicate RPM values are skipped since the segment length is then zero.
+        if(point[seg + 1].rpm > point[seg].rpm)
+            rpm = point[seg].pwm + (rpm - point[seg].rpm) * (point[seg + 1].pwm - point[seg].pwm) / (point[seg + 1].rpm - point[seg].rpm);
+        else
+            rpm = point[seg + 1].pwm;
+
+        lut.duty[idx] = (uint16_t)lroundf(rpm * 100.0f);
+    }
+}
+
+// Returns duty cycle in 1/100 percent.
+static uint_fast16_t lut_duty (float rpm)
+{
+    float pos = (rpm - lut.rpm_min) * lut.scale;
+    uint_fast16_t idx;
+
+    if(pos <= 0.0f)
+        return lut.duty[0];
+
+    if(pos >= (float)(PWM2_LUT_SIZE - 1))
+        return lut.duty[PWM2_LUT_SIZE - 1];
+
+    idx = (uint_fast16_t)pos;
+
+    return (uint_fast16_t)((float)lut.duty[idx] + (pos - (float)idx) * (float)((int32_t)lut.duty[idx + 1] - (int32_t)lut.duty[idx]) + 0.5f);
+}
+
+/*
+  PWM values are precomputed by the core as for the driver PWM spindle, with a virtual clock giving a period of
+  PWM2_RESOLUTION counts, and output to the PWM port configured to take the duty cycle in percent.
+  In laser mode the core calls spindleGetPWM() when preparing step segments and spindleUpdatePWM() from the
+  stepper interrupt for dynamic power (M4). Laser mode is only supported if the PWM port is not on an external
+  I/O expander since ioport_analog_out() is then not safe to call from an interrupt context.
+*/
+
+static uint_fast16_t spindleGetPWM (spindle_ptrs_t *spindle, float rpm)
+{
+    UNUSED(spindle);
+
+    return lut.enabled && rpm > 0.0f ? lut_duty(rpm) : pwm_data.compute_value(&pwm_data, rpm, false);
+}
+
+static void spindleUpdatePWM (spindle_ptrs_t *spindle, uint_fast16_t pwm_value)
+{
+    UNUSED(spindle);
+
+    ioport_analog_out(port_pwm, (float)pwm_value * pwm_scale);
+}
 
 static void spindleSetState (spindle_ptrs_t *spindle, spindle_state_t state, float rpm)
 {
@@ -50,9 +174,19 @@ static void spindleSetState (spindle_ptrs_t *spindle, spindle_state_t state, flo
 
 static spindle_state_t spindleGetState (spindle_ptrs_t *spindle)
 {
+    spindle_state_t state = spindle_state;
+
     UNUSED(spindle);
 
-    return spindle_state;
+    state.at_speed = state.on && spindle_ramp_at_target(&ramp);
+
+    return state;
+}
+
+// Outputs the soft start ramp setpoint, may be called from an interrupt context. Not used for external ports.
+static void rampOutput (float rpm)
+{
+    spindleUpdatePWM(NULL, spindleGetPWM(NULL, rpm));
 }
 
 // Sets spindle speed
@@ -60,7 +194,7 @@ static void spindleSetSpeed (spindle_ptrs_t *spindle, float rpm)
 {
     UNUSED(spindle);
 
-    ioport_analog_out(port_pwm, rpm);
+    spindle_ramp_set(&ramp, rpm);
 }
 
 // Start or stop spindle
@@ -74,7 +208,7 @@ static void spindleSetStateVariable (spindle_ptrs_t *spindle, spindle_state_t st
         ioport_digital_out(port_dir, state.ccw);
 
     ioport_digital_out(port_on, state.on);
-    ioport_analog_out(port_pwm, rpm);
+    spindle_ramp_set(&ramp, state.on ? rpm : 0.0f);
 }
 
 static bool spindleConfig (spindle_ptrs_t *spindle)
@@ -86,11 +220,11 @@ static bool spindleConfig (spindle_ptrs_t *spindle)
 
     pwm_config_t config;
 
+    lut_build(&spindle_config->cfg);
+
     config.freq_hz = spindle_config->cfg.pwm_freq;
-    config.min = spindle_config->cfg.rpm_min;
-    config.max = spindle_config->cfg.rpm_max;
-    config.min_value = spindle_config->cfg.pwm_min_value;
-    config.max_value = spindle_config->cfg.pwm_max_value;
+    config.min = config.min_value = 0.0f;
+    config.max = config.max_value = 100.0f;
     config.off_value = spindle_config->cfg.pwm_off_value;
     config.invert = Off; // TODO: add setting
 
@@ -105,7 +239,17 @@ static bool spindleConfig (spindle_ptrs_t *spindle)
     } else
         config_ok = true;
 
-    spindle->set_state = pwm_port.config(&pwm_port, &config, false) ? spindleSetStateVariable : spindleSetState;
+    spindle->context.pwm = &pwm_data;
+    spindle->set_state = spindle_precompute_pwm_values(spindle, &pwm_data, &spindle_config->cfg, (uint32_t)spindle_config->cfg.pwm_freq * PWM2_RESOLUTION) &&
+                          pwm_port.config(&pwm_port, &config, false) ? spindleSetStateVariable : spindleSetState;
+    spindle->cap.laser = spindle->set_state == spindleSetStateVariable && !pwm_port.cap.external;
+    pwm_scale = pwm_data.period ? 100.0f / (float)pwm_data.period : 0.0f;
+
+    // No soft start in laser mode, power has to follow motion. Nor for external ports as the ramp output may be
+    // called from an interrupt context and these cannot be written to from there.
+    mode = settings.mode;
+    spindle->cap.at_speed = plugin_settings.ramp_time > 0 && mode != Mode_Laser && !pwm_port.cap.external;
+    spindle_ramp_configure(&ramp, spindle_config->cfg.rpm_max, spindle->cap.at_speed ? plugin_settings.ramp_time : 0);
 
     return true;
 }
@@ -118,10 +262,13 @@ PROGMEM static const spindle_ptrs_t spindle = {
         .direction = On,
 #endif
         .variable = On,
+        .laser = On,
 //          .pwm_invert = On,
         .gpio_controlled = On
     },
     .config = spindleConfig,
+    .get_pwm = spindleGetPWM,
+    .update_pwm = spindleUpdatePWM,
     .update_rpm = spindleSetSpeed,
     .set_state = spindleSetStateVariable,
     .get_state = spindleGetState
@@ -174,11 +321,129 @@ static void spindle_settings_changed (spindle1_pwm_settings_t *settings)
     spindleConfig(spindle_get_hal(spindle_id, SpindleHAL_Configured));
 }
 
+// Soft start is disabled in laser mode, the spindle is reconfigured when the machine mode ($32) is changed.
+static void onSettingsChanged (settings_t *settings, settings_changed_flags_t changed)
+{
+    spindle_ptrs_t *spindle;
+
+    settings_changed(settings, changed);
+
+    if(spindle_id != -1 && settings->mode != mode && (spindle = spindle_get_hal(spindle_id, SpindleHAL_Configured))) {
+
+        spindle_ptrs_t *spindle_hal;
+
+        spindleConfig(spindle);
+
+        if((spindle_hal = spindle_get_hal(spindle_id, SpindleHAL_Active))) {
+            spindle_hal->cap.at_speed = spindle->cap.at_speed;
+            spindle_hal->cap.laser = spindle->cap.laser;
+        }
+    }
+}
+
+static status_code_t set_lut_point (setting_id_t id, char *svalue)
+{
+    float rpm, pwm;
+    uint_fast8_t cc = 0;
+    pwm_point_t *point = &plugin_settings.point[id - Setting_PWM2Spindle_Piece1];
+
+    if(*svalue == '\0') {
+        point->rpm = point->pwm = 0.0f;
+        return Status_OK;
+    }
+
+    if(!(read_float(svalue, &cc, &rpm) && svalue[cc++] == ',' && read_float(svalue, &cc, &pwm) && svalue[cc] == '\0'))
+        return Status_BadNumberFormat;
+
+    if(rpm < 0.0f || pwm < 0.0f || pwm > 100.0f)
+        return Status_InvalidStatement;
+
+    point->rpm = rpm;
+    point->pwm = pwm;
+
+    return Status_OK;
+}
+
+static char *get_lut_point (setting_id_t id)
+{
+    static char buf[24];
+
+    pwm_point_t *point = &plugin_settings.point[id - Setting_PWM2Spindle_Piece1];
+
+    *buf = '\0';
+
+    if(point->rpm > 0.0f) {
+        strcat(buf, ftoa(point->rpm, 0));
+        strcat(buf, ",");
+        strcat(buf, ftoa(point->pwm, 1));
+    }
+
+    return buf;
+}
+
+PROGMEM static const setting_detail_t plugin_settings_detail[] = {
+    { Setting_PWM2Spindle_Piece1, Group_Spindle, "PWM2 spindle calibration point 1", "RPM,%", Format_String, "x(20)", NULL, "20", Setting_NonCoreFn, set_lut_point, get_lut_point, NULL, { .allow_null = On } },
+    { Setting_PWM2Spindle_Piece2, Group_Spindle, "PWM2 spindle calibration point 2", "RPM,%", Format_String, "x(20)", NULL, "20", Setting_NonCoreFn, set_lut_point, get_lut_point, NULL, { .allow_null = On } },
+    { Setting_PWM2Spindle_Piece3, Group_Spindle, "PWM2 spindle calibration point 3", "RPM,%", Format_String, "x(20)", NULL, "20", Setting_NonCoreFn, set_lut_point, get_lut_point, NULL, { .allow_null = On } },
+    { Setting_PWM2Spindle_Piece4, Group_Spindle, "PWM2 spindle calibration point 4", "RPM,%", Format_String, "x(20)", NULL, "20", Setting_NonCoreFn, set_lut_point, get_lut_point, NULL, { .allow_null = On } },
+    { Setting_PWM2Spindle_RampTime, Group_Spindle, "PWM2 spindle ramp time", "ms", Format_Int16, "####0", "0", "65535", Setting_NonCore, &plugin_settings.ramp_time, NULL, NULL }
+};
+
+PROGMEM static const setting_descr_t plugin_settings_descr[] = {
+    { Setting_PWM2Spindle_Piece1, "Calibration point for piecewise linear RPM to PWM mapping, format is <RPM>,<PWM %>. Leave blank to disable.\\n"
+                                    "Points between min and max spindle RPM are used, end points are given by the min and max PWM settings."
+    },
+    { Setting_PWM2Spindle_Piece2, "Calibration point for piecewise linear RPM to PWM mapping, format is <RPM>,<PWM %>. Leave blank to disable." },
+    { Setting_PWM2Spindle_Piece3, "Calibration point for piecewise linear RPM to PWM mapping, format is <RPM>,<PWM %>. Leave blank to disable." },
+    { Setting_PWM2Spindle_Piece4, "Calibration point for piecewise linear RPM to PWM mapping, format is <RPM>,<PWM %>. Leave blank to disable." },
+    { Setting_PWM2Spindle_RampTime, "Soft start ramp time from 0 to max RPM, speed changes are ramped at the same rate and at speed is reported when the ramp ends.\\n"
+                             "Set to 0 to disable, not used in laser mode or if the PWM output is on an external port."
+    }
+};
+
+static void plugin_settings_save (void)
+{
+    hal.nvs.memcpy_to_nvs(nvs_address, (uint8_t *)&plugin_settings, sizeof(pwm2_settings_t), true);
+
+    if(spindle_id != -1)
+        spindleConfig(spindle_get_hal(spindle_id, SpindleHAL_Configured));
+}
+
+static void plugin_settings_restore (void)
+{
+    memset(&plugin_settings, 0, sizeof(pwm2_settings_t));
+
+    hal.nvs.memcpy_to_nvs(nvs_address, (uint8_t *)&plugin_settings, sizeof(pwm2_settings_t), true);
+}
+
+static void plugin_settings_load (void)
+{
+    if(hal.nvs.memcpy_from_nvs((uint8_t *)&plugin_settings, nvs_address, sizeof(pwm2_settings_t), true) != NVS_TransferResult_OK)
+        plugin_settings_restore();
+}
+
 void pwm_spindle_init (void)
 {
-    if((spindle_config = spindle1_settings_add(true)))
+    static setting_details_t setting_details = {
+        .settings = plugin_settings_detail,
+        .n_settings = sizeof(plugin_settings_detail) / sizeof(setting_detail_t),
+        .descriptions = plugin_settings_descr,
+        .n_descriptions = sizeof(plugin_settings_descr) / sizeof(setting_descr_t),
+        .save = plugin_settings_save,
+        .load = plugin_settings_load,
+        .restore = plugin_settings_restore
+    };
+
+    if((spindle_config = spindle1_settings_add(true))) {
+        spindle_ramp_register(&ramp, rampOutput);
         spindle1_settings_register(spindle.cap, spindle_settings_changed);
-    else
+
+        settings_changed = hal.settings_changed;
+        hal.settings_changed = onSettingsChanged;
+
+        if((nvs_address = nvs_alloc(sizeof(pwm2_settings_t))))
+            settings_register(&setting_details);
+    } else
         task_run_on_startup(report_warning, "PWM2 spindle failed to initialize!");
 }
 
@@ -36,6 +36,17 @@ static spindle_ptrs_t spindle1;
 static spindle1_pwm_settings_t *spindle_config;
 static spindle_state_t spindle0_state = {0}, spindle1_state = {0};
 static spindle_pwm_t pwm_data;
+static struct {
+    uint32_t version;               // incremented on spindle settings changes
+    uint32_t computed;              // settings version pwm_data was computed from, 0 if not computed
+    uint32_t f_clock;
+    machine_mode_t mode;
+    spindle_settings_t pwm_spindle; // core PWM spindle settings pwm_data was computed from
+    bool variable;                  // values set in the spindle struct by the last computation,
+                                    // copied to the spindle struct when pwm_data is reused
+    float rpm_min;
+    float rpm_max;
+} pwm_cache = { .version = 1 };
 static on_spindle_selected_ptr on_spindle_selected;
 static spindle_set_state_ptr set_state;
 
@@ -72,6 +83,33 @@ static spindle_state_t spindle1GetState (spindle_ptrs_t *spindle)
     return spindle1_state;
 }
 
+/*
+  Precomputed values are kept across spindle selections and only recomputed when an input has changed.
+  spindle_precompute_pwm_values() also sets fields in the spindle struct passed, and this differs between callers,
+  so the fields it derives are saved with pwm_data and always copied to the spindle struct.
+*/
+static void precompute_pwm_values (spindle_ptrs_t *spindle, uint32_t f_clock)
+{
+    spindle->context.pwm = &pwm_data;
+    spindle_config->cfg.pwm_freq = settings.pwm_spindle.pwm_freq;
+
+    if(pwm_cache.computed != pwm_cache.version || pwm_cache.f_clock != f_clock || pwm_cache.mode != settings.mode ||
+        memcmp(&pwm_cache.pwm_spindle, &settings.pwm_spindle, sizeof(spindle_settings_t))) {
+        spindle_precompute_pwm_values(spindle, &pwm_data, &spindle_config->cfg, f_clock);
+        pwm_cache.variable = spindle->cap.variable;
+        pwm_cache.rpm_min = spindle->rpm_min;
+        pwm_cache.rpm_max = spindle->rpm_max;
+        pwm_cache.computed = pwm_cache.version;
+        pwm_cache.f_clock = f_clock;
+        pwm_cache.mode = settings.mode;
+        memcpy(&pwm_cache.pwm_spindle, &settings.pwm_spindle, sizeof(spindle_settings_t));
+    } else {
+        spindle->cap.variable = pwm_cache.variable;
+        spindle->rpm_min = pwm_cache.rpm_min;
+        spindle->rpm_max = pwm_cache.rpm_max;
+    }
+}
+
 static bool Spindle1Configure (spindle_ptrs_t *spindle)
 {
     spindle_ptrs_t *spindle0 = spindle_get_hal(0, SpindleHAL_Configured);
@@ -80,11 +118,8 @@ static bool Spindle1Configure (spindle_ptrs_t *spindle)
     spindle->rpm_min = spindle_config->cfg.rpm_min;
     spindle->rpm_max = spindle_config->cfg.rpm_max;
 
-    if(spindle0 && spindle0->context.pwm) {
-        spindle->context.pwm = &pwm_data;
-        spindle_config->cfg.pwm_freq = settings.pwm_spindle.pwm_freq;
-        spindle_precompute_pwm_values(spindle, &pwm_data, &spindle_config->cfg, spindle0->context.pwm->f_clock);
-    }
+    if(spindle0 && spindle0->context.pwm)
+        precompute_pwm_values(spindle, spindle0->context.pwm->f_clock);
 
     return spindle->context.pwm != NULL;
 }
@@ -100,11 +135,9 @@ static void onSpindleSelected (spindle_ptrs_t *spindle)
         spindle->get_state = spindle0GetState;
         spindle->cap.direction = settings.mode == Mode_Laser;
         spindle->context.pwm->flags.cloned = On;
-        if(spindle->context.pwm) {
-            spindle1.context.pwm = &pwm_data;
-            spindle_config->cfg.pwm_freq = settings.pwm_spindle.pwm_freq;
-            spindle_precompute_pwm_values(&spindle1, &pwm_data, &spindle_config->cfg, spindle->context.pwm->f_clock);
-        } else
+        if(spindle->context.pwm)
+            precompute_pwm_values(&spindle1, spindle->context.pwm->f_clock);
+        else
             spindle1.context.pwm = NULL;
     }
 }
@@ -117,6 +150,9 @@ static void warn_disabled (sys_state_t state)
 
 static void spindle_settings_changed (spindle1_pwm_settings_t *settings)
 {
+    if(++pwm_cache.version == 0)
+        pwm_cache.version = 1;
+
     if(spindle1.context.pwm)
         Spindle1Configure(&spindle1);
 }
@@ -0,0 +1,143 @@
+/*
+
+  ramp.c - spindle soft start ramp
+
+  Part of grblHAL
+
+  Copyright (c) 2026 Terje Io
+
+  grblHAL is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  grblHAL is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with grblHAL. If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include "shared.h"
+
+#if SPINDLE_ENABLE & ((1<<SPINDLE_PWM2)|(1<<SPINDLE_PWM2_NODIR)|(1<<SPINDLE_ONOFF1)|(1<<SPINDLE_ONOFF1_DIR))
+
+/*
+  The setpoint of each active ramp is moved towards its target every SPINDLE_RAMP_PERIOD ms and output via the
+  ramp output function. A periodic hardware timer is used if the driver provides one, the output function is then
+  called from the timer interrupt. If not the ramp is run from the foreground process by a delayed task.
+
+  The timer is claimed when a ramp is first started, so that no timer is taken when ramps are not configured and
+  plugins claiming a timer on startup, e.g. the stepper spindle, get theirs first. The HAL does not provide a call
+  for releasing a timer, once claimed it is kept and stopped when no ramp is active.
+*/
+
+#define N_RAMPS 2
+
+static uint_fast8_t n_ramps = 0;
+static spindle_ramp_t *ramps[N_RAMPS];
+static hal_timer_t timer = NULL;
+static bool timer_claimed = false;
+static volatile bool running = false;
+
+static void ramp_step (void *context)
+{
+    bool active = false;
+    uint_fast8_t idx = n_ramps;
+    spindle_ramp_t *ramp;
+
+    do {
+        if((ramp = ramps[--idx])->active) {
+
+            if(ramp->rpm < ramp->target) {
+                if((ramp->rpm += ramp->rate) > ramp->target)
+                    ramp->rpm = ramp->target;
+            } else if((ramp->rpm -= ramp->rate) < ramp->target)
+                ramp->rpm = ramp->target;
+
+            if(ramp->output)
+                ramp->output(ramp->rpm);
+
+            active |= (ramp->active = ramp->rpm != ramp->target);
+        }
+    } while(idx);
+
+    if(!active) {
+        running = false;
+        if(timer)
+            hal.timer.stop(timer);
+    } else if(!timer)
+        task_add_delayed(ramp_step, NULL, SPINDLE_RAMP_PERIOD);
+}
+
+static void timer_claim (void)
+{
+    timer_cfg_t cfg = {
+        .single_shot = Off,
+        .timeout_callback = ramp_step
+    };
+
+    timer_claimed = true;
+
+    if(hal.timer.claim && (timer = hal.timer.claim((timer_cap_t){ .periodic = On }, 1000)) && !hal.timer.configure(timer, &cfg))
+        timer = NULL;
+}
+
+/*! \brief Register a ramp.
+\param ramp pointer to a \a spindle_ramp_t struct, must be in static storage.
+\param output pointer to a function that outputs the ramp setpoint, may be NULL if ramp is used for timing only.
+\returns true if successful, false if no more ramps can be registered.
+*/
+bool spindle_ramp_register (spindle_ramp_t *ramp, spindle_ramp_output_ptr output)
+{
+    if(n_ramps == N_RAMPS)
+        return false;
+
+    memset(ramp, 0, sizeof(spindle_ramp_t));
+    ramp->output = output;
+    ramps[n_ramps++] = ramp;
+
+    return true;
+}
+
+/*! \brief Configure a ramp.
+\param ramp pointer to a registered \a spindle_ramp_t struct.
+\param range setpoint change for a full ramp, e.g. max RPM.
+\param ramp_time time in ms for a full ramp, 0 to disable the ramp.
+*/
+void spindle_ramp_configure (spindle_ramp_t *ramp, float range, uint16_t ramp_time)
+{
+    ramp->rate = ramp_time > 0 ? range * (float)SPINDLE_RAMP_PERIOD / (float)ramp_time : 0.0f;
+}
+
+/*! \brief Set ramp target.
+Ramps from the current setpoint to the target, targets <= 0 are output immediately.
+\param ramp pointer to a registered \a spindle_ramp_t struct.
+\param target target setpoint, e.g. programmed RPM.
+*/
+void spindle_ramp_set (spindle_ramp_t *ramp, float target)
+{
+    ramp->target = target;
+
+    if(ramp->rate <= 0.0f || target <= 0.0f) {
+        ramp->active = false;
+        ramp->rpm = target;
+        if(ramp->output)
+            ramp->output(target);
+    } else if(target != ramp->rpm) {
+        ramp->active = true;
+        if(!timer_claimed && !running)
+            timer_claim();
+        // Restarting the timer is harmless, the delayed task is only added when the ramp engine is not running.
+        if(timer)
+            hal.timer.start(timer, SPINDLE_RAMP_PERIOD * 1000);
+        else if(!running)
+            task_add_delayed(ramp_step, NULL, SPINDLE_RAMP_PERIOD);
+        running = true;
+    }
+}
+
+#endif
@@ -27,4 +27,28 @@
 
 int8_t spindle_select_get_binding (spindle_id_t spindle_id);
 
+#ifndef SPINDLE_RAMP_PERIOD
+#define SPINDLE_RAMP_PERIOD 10 // ms
+#endif
+
+typedef void (*spindle_ramp_output_ptr)(float rpm);
+
+typedef struct {
+    volatile bool active;
+    float rpm;      // current setpoint
+    float target;
+    float rate;     // setpoint change per ramp period
+    spindle_ramp_output_ptr output;
+} spindle_ramp_t;
+
+bool spindle_ramp_register (spindle_ramp_t *ramp, spindle_ramp_output_ptr output);
+void spindle_ramp_configure (spindle_ramp_t *ramp, float range, uint16_t ramp_time);
+void spindle_ramp_set (spindle_ramp_t *ramp, float target);
+
+//! Returns true when the ramp has reached its target.
+static inline bool spindle_ramp_at_target (spindle_ramp_t *ramp)
+{
+    return !ramp->active;
+}
+
 /**/
@@ -28,67 +28,446 @@
 
 #if SPINDLE_ENABLE & (1<<SPINDLE_STEPPER)
 
-#if N_AXIS < 4
+#ifndef N_STEPPER_SPINDLE
+#define N_STEPPER_SPINDLE 1
+#endif
+
+#if N_STEPPER_SPINDLE > 2
+#error Max two stepper spindles are supported!
+#endif
+
+#if N_AXIS < 3 + N_STEPPER_SPINDLE
 #error Stepper spindle can only bind to an axis > Z axis!
 #endif
 
 #include "grbl/stepper2.h"
 #include "grbl/protocol.h"
 #include "grbl/state_machine.h"
+#include "grbl/nvs_buffer.h"
+
+#ifndef STEPPER_SPINDLE_SCURVE_PERIOD
+#define STEPPER_SPINDLE_SCURVE_PERIOD 5 // ms, S-curve setpoint update interval
+#endif
 
-static spindle_id_t spindle_id = -1;
-static const uint8_t axis_idx = N_AXIS - 1, axis_mask = 1 << (N_AXIS - 1);
-static int64_t offset = 0, eoffset = 0, cfactor = 1;
-static bool stopping = false, running = false;
-static st2_motor_t *motor;
-static spindle_data_t spindle_data = {0};
+#ifndef STEPPER_SPINDLE_ORIENT_RPM
+#define STEPPER_SPINDLE_ORIENT_RPM 60.0f // RPM, speed for orientation moves
+#endif
+
+#define Spindle_Orient (user_mcode_t)19
+
+#if N_AXIS == 4
+#define STEPPER_SPINDLE_AXES "A"
+#elif N_AXIS == 5
+#define STEPPER_SPINDLE_AXES "A,B"
+#elif N_AXIS == 6
+#define STEPPER_SPINDLE_AXES "A,B,C"
+#elif N_AXIS == 7
+#define STEPPER_SPINDLE_AXES "A,B,C,U"
+#else
+#define STEPPER_SPINDLE_AXES "A,B,C,U,V"
+#endif
+
+typedef struct {
+    float jerk;                         // rev/sec^3, 0 for trapezoidal acceleration
+    uint8_t step_timer_khz;             // step generation timer frequency when the driver uses polling, 0 to poll from the main loop
+    uint8_t axis[N_STEPPER_SPINDLE];    // bound axis, 0 is the A axis
+} stepper_spindle_settings_t;
+
+typedef enum {
+    Orient_Shortest = 0,
+    Orient_CW,
+    Orient_CCW
+} orient_dir_t;
+
+typedef struct {
+    uint32_t position;      // position at last update
+    uint32_t index;         // completed revolutions
+    uint64_t remainder;     // steps into current revolution, scaled as steps
+} rev_count_t;
+
+typedef struct {
+    spindle_id_t id;
+    uint8_t axis_idx;
+    uint8_t axis_mask;
+    st2_motor_t *motor;
+    int64_t offset;
+    int64_t eoffset;
+    int64_t cfactor;
+    bool stopping;
+    bool running;
+    bool ccw;               // direction of last move
+    bool orienting;
+    volatile bool updating; // motor is updated from the foreground process, step generation from the timer is held off
+    struct {
+        bool pending;
+        bool ccw;
+        float rpm;
+    } reversal;
+    struct {
+        bool active;
+        bool stop;
+        float rpm;          // commanded RPM
+        float target;       // target RPM
+        float accel;        // current acceleration, RPM/s
+        float accel_max;    // RPM/s
+        float jerk;         // RPM/s^2
+    } scurve;
+    struct {
+        uint64_t steps;         // steps per revolution, Q16.16 when not integral
+        uint_fast8_t shift;     // 0 if steps per revolution is integral, else 16
+        float fraction_scale;   // 1 / steps
+        volatile uint_fast8_t current; // published count, the other is written by the foreground process
+        rev_count_t count[2];
+    } rev;
+    struct {
+        int64_t position;       // motor position at last update
+        int32_t revs;           // revolutions since offset, floored
+        int64_t remainder;      // position - offset modulo steps per revolution, scaled as rev.steps
+    } wrap;
+    spindle_data_t spindle_data;
+    axis_settings_t motor_settings;
+} stepper_spindle_t;
+
+static stepper_spindle_t stepper_spindle[N_STEPPER_SPINDLE] = {0};
+static bool poll = false;
+static hal_timer_t step_timer = NULL;
+static nvs_address_t nvs_address;
+static stepper_spindle_settings_t stepper_config;
 static axes_signals_t steppers_enabled = {0};
-static axis_settings_t motor_settings;
 
-static on_execute_realtime_ptr on_execute_realtime = NULL, on_execute_delay;
+static on_execute_realtime_ptr on_execute_realtime = NULL, on_execute_delay = NULL;
 static stepper_enable_ptr stepper_enable;
 static settings_changed_ptr settings_changed;
 static driver_settings_save_ptr settings_save;
+static user_mcode_ptrs_t user_mcode;
+static on_spindle_selected_ptr on_spindle_selected;
+
+static void revolutions_poll (stepper_spindle_t *sp);
+
+// Returns NULL if the spindle is not a bound stepper spindle, only bound instances are registered.
+static stepper_spindle_t *get_spindle (spindle_ptrs_t *spindle)
+{
+    uint_fast8_t idx = N_STEPPER_SPINDLE;
+
+    do {
+        if(stepper_spindle[--idx].motor && stepper_spindle[idx].id == spindle->id)
+            return &stepper_spindle[idx];
+    } while(idx);
+
+    return NULL;
+}
+
+static bool is_running (void)
+{
+    uint_fast8_t idx = N_STEPPER_SPINDLE;
+
+    do {
+        if(stepper_spindle[--idx].running)
+            return true;
+    } while(idx);
+
+    return false;
+}
 
 static void stepperEnable (axes_signals_t enable, bool hold)
 {
+    uint_fast8_t idx = N_STEPPER_SPINDLE;
+
     steppers_enabled = enable;
 
-    if(running)
-        enable.mask |= axis_mask;
+    do {
+        if(stepper_spindle[--idx].running)
+            enable.mask |= stepper_spindle[idx].axis_mask;
+    } while(idx);
 
     stepper_enable(enable, hold);
 }
 
-static void onSpindleStopped (void *data)
+/*
+  The motor library is not reentrant, when steps are generated from the step timer interrupt foreground calls that
+  change the motor state are bracketed by motor_update_begin() and motor_update_end(). The timer interrupt skips
+  the motor while an update is in progress, the step is then generated one timer period later.
+*/
+
+static inline void motor_update_begin (stepper_spindle_t *sp)
 {
-    if(stopping) {
+    sp->updating = true;
+}
 
-        stopping = running = false;
-        hal.stepper.enable(steppers_enabled, false);
+static inline void motor_update_end (stepper_spindle_t *sp)
+{
+    sp->updating = false;
+}
 
-        if(hal.stepper.claim_motor && settings.stepper_spindle_flags.allow_axis_control) {
+/*
+  Jerk limited (S-curve) acceleration.
 
-            hal.stepper.claim_motor(axis_idx, false);
+  The motor library accelerates along a trapezoidal profile, when a jerk value is configured the speed setpoint
+  is instead moved towards the target every STEPPER_SPINDLE_SCURVE_PERIOD ms with an acceleration that is ramped
+  up and down by the jerk value and capped by the axis acceleration setting. Since the setpoint never changes
+  faster than the axis acceleration the motor library follows it without applying its own trapezoid.
+*/
 
-            if(settings.stepper_spindle_flags.sync_position) {
+// Advances the setpoint by one period, returns false when the target is reached.
+static bool scurve_update (stepper_spindle_t *sp)
+{
+    static const float dt = (float)STEPPER_SPINDLE_SCURVE_PERIOD / 1000.0f;
+
+    float dv = sp->scurve.target - sp->scurve.rpm, dir = dv < 0.0f ? -1.0f : 1.0f;
+
+    // Start reducing acceleration when the velocity change needed to bring it to zero is reached.
+    if(dir * sp->scurve.accel > 0.0f && fabsf(dv) <= sp->scurve.accel * sp->scurve.accel / (2.0f * sp->scurve.jerk) + fabsf(sp->scurve.accel) * dt) {
+        sp->scurve.accel -= dir * sp->scurve.jerk * dt;
+        if(dir * sp->scurve.accel < sp->scurve.jerk * dt)
+            sp->scurve.accel = dir * sp->scurve.jerk * dt;
+    } else {
+        sp->scurve.accel += dir * sp->scurve.jerk * dt;
+        if(fabsf(sp->scurve.accel) > sp->scurve.accel_max)
+            sp->scurve.accel = dir * sp->scurve.accel_max;
+    }
 
-                spindle_ptrs_t *spindle;
+    sp->scurve.rpm += sp->scurve.accel * dt;
+
+    if(dir * (sp->scurve.rpm - sp->scurve.target) >= 0.0f || (sp->scurve.stop && sp->scurve.rpm <= sp->scurve.accel_max * dt)) {
+        sp->scurve.rpm = sp->scurve.target;
+        sp->scurve.accel = 0.0f;
+    }
+
+    return sp->scurve.rpm != sp->scurve.target;
+}
+
+static void scurve_step (void *data)
+{
+    stepper_spindle_t *sp = (stepper_spindle_t *)data;
 
-                if((spindle = spindle_get(spindle_id)) && spindle->get_data) {
+    if(!sp->scurve.active)
+        return;
 
-                    float ftmp;
+    sp->scurve.active = scurve_update(sp);
 
-                    if(modff(settings.axis[axis_idx].steps_per_mm, &ftmp) == 0.0f)
-                        sys.position[axis_idx] = (int32_t)((st2_get_position(motor) - offset) % (int64_t)motor_settings.steps_per_mm);
+    motor_update_begin(sp);
+    if(sp->scurve.stop && !sp->scurve.active)
+        st2_motor_stop(sp->motor); // Remaining speed is below one period of max. acceleration.
+    else
+        st2_motor_set_speed(sp->motor, sp->scurve.rpm);
+    motor_update_end(sp);
 
-                    else {
+    if(sp->scurve.active)
+        task_add_delayed(scurve_step, sp, STEPPER_SPINDLE_SCURVE_PERIOD);
+}
+
+// Stops the ramp, the pending update is removed so that a restart does not add a second update chain.
+static void scurve_cancel (stepper_spindle_t *sp)
+{
+    if(sp->scurve.active) {
+        sp->scurve.active = false;
+        task_delete(scurve_step, sp);
+    }
+}
+
+static void scurve_set_target (stepper_spindle_t *sp, float rpm)
+{
+    sp->scurve.target = rpm;
+    sp->scurve.stop = rpm == 0.0f;
+
+    if(!sp->scurve.active) {
+        sp->scurve.rpm = st2_get_speed(sp->motor);
+        sp->scurve.accel = 0.0f;
+        if((sp->scurve.active = sp->scurve.rpm != rpm))
+            task_add_delayed(scurve_step, sp, STEPPER_SPINDLE_SCURVE_PERIOD);
+    }
+}
+
+static void motor_start (stepper_spindle_t *sp, bool ccw, float rpm)
+{
+    sp->ccw = ccw;
+
+    motor_update_begin(sp);
+
+    if(sp->scurve.jerk > 0.0f && rpm > 0.0f) {
+        scurve_cancel(sp);
+        sp->scurve.rpm = sp->scurve.accel = 0.0f;
+        sp->scurve.target = rpm;
+        sp->scurve.stop = false;
+        if((sp->scurve.active = scurve_update(sp)))
+            task_add_delayed(scurve_step, sp, STEPPER_SPINDLE_SCURVE_PERIOD);
+        st2_motor_move(sp->motor, ccw ? -1.0f : 1.0f, sp->scurve.rpm, Stepper2_InfiniteSteps);
+    } else
+        st2_motor_move(sp->motor, ccw ? -1.0f : 1.0f, rpm, Stepper2_InfiniteSteps);
+
+    motor_update_end(sp);
+}
+
+static void motor_set_speed (stepper_spindle_t *sp, float rpm)
+{
+    if(sp->scurve.jerk > 0.0f)
+        scurve_set_target(sp, rpm);
+    else {
+        motor_update_begin(sp);
+        st2_motor_set_speed(sp->motor, rpm);
+        motor_update_end(sp);
+    }
+}
+
+// Returns true if the motor is decelerating to a stop, the stopped callback will then be called.
+static bool motor_stop (stepper_spindle_t *sp)
+{
+    bool stopping;
+
+    if(sp->scurve.jerk > 0.0f && st2_motor_running(sp->motor)) {
+        scurve_set_target(sp, 0.0f);
+        if(!sp->scurve.active) {
+            motor_update_begin(sp);
+            st2_motor_stop(sp->motor);
+            motor_update_end(sp);
+        }
+        return true;
+    }
+
+    scurve_cancel(sp);
+
+    motor_update_begin(sp);
+    stopping = st2_motor_stop(sp->motor);
+    motor_update_end(sp);
+
+    return stopping;
+}
+
+static inline bool motor_cruising (stepper_spindle_t *sp)
+{
+    return !sp->scurve.active && st2_motor_cruising(sp->motor);
+}
+
+// Motor has decelerated to a stop for a direction change, accelerate in the new direction.
+static void reverse_direction (stepper_spindle_t *sp)
+{
+    sp->reversal.pending = false;
+    motor_start(sp, sp->reversal.ccw, sp->reversal.rpm);
+}
 
-                        double pos, tmp;
-                        pos = modf((double)(st2_get_position(motor) - offset) / (double)motor_settings.steps_per_mm, &tmp);
+/*
+  Timer driven step generation.
+
+  When the driver only offers polling steps are normally generated from the main loop and the step timing then
+  depends on how busy it is. If a hardware timer is available and a frequency is configured it is used to call
+  the motor library instead, the step timing jitter is then bounded by the timer period.
+*/
+
+static void onStepTimer (void *context)
+{
+    uint_fast8_t idx = N_STEPPER_SPINDLE;
+
+    do {
+        if(stepper_spindle[--idx].motor && !stepper_spindle[idx].updating)
+            st2_motor_run(stepper_spindle[idx].motor);
+    } while(idx);
+}
+
+static void step_timer_claim (void)
+{
+    timer_cfg_t cfg = {
+        .single_shot = Off,
+        .timeout_callback = onStepTimer
+    };
 
-                        sys.position[axis_idx] = lround(pos * (double)motor_settings.steps_per_mm);
-                    }
+    if(poll && step_timer == NULL && stepper_config.step_timer_khz && hal.timer.claim &&
+        (step_timer = hal.timer.claim((timer_cap_t){ .periodic = On }, 1000)) && !hal.timer.configure(step_timer, &cfg))
+        step_timer = NULL;
+}
+
+static inline void step_timer_start (void)
+{
+    if(step_timer)
+        hal.timer.start(step_timer, 1000 / stepper_config.step_timer_khz); // period in us
+}
+
+static inline void step_timer_stop (void)
+{
+    if(step_timer)
+        hal.timer.stop(step_timer);
+}
+
+/*
+  Position within one revolution for handing the axis back to motion control when the spindle stops.
+
+  The position relative to the offset is wrapped incrementally from the foreground process while the spindle runs,
+  with the remainder scaled as rev.steps so that fractional steps per revolution accumulate without drift.
+  A division is only needed when the motor is started or if the position has moved more than a few revolutions
+  since the last update, a stop is thus constant-time.
+*/
+
+static void wrap_sync (stepper_spindle_t *sp)
+{
+    int64_t total = (st2_get_position(sp->motor) - sp->offset) * (1LL << sp->rev.shift), steps = (int64_t)sp->rev.steps;
+
+    sp->wrap.position = st2_get_position(sp->motor);
+    sp->wrap.revs = (int32_t)(total / steps);
+    sp->wrap.remainder = total - (int64_t)sp->wrap.revs * steps;
+
+    if(sp->wrap.remainder < 0) {
+        sp->wrap.remainder += steps;
+        sp->wrap.revs--;
+    }
+}
+
+static void wrap_update (stepper_spindle_t *sp)
+{
+    int64_t position = st2_get_position(sp->motor), steps = (int64_t)sp->rev.steps,
+            remainder = sp->wrap.remainder + (position - sp->wrap.position) * (1LL << sp->rev.shift);
+
+    if(remainder >= (steps << 2) || remainder <= -(steps << 2)) {
+        wrap_sync(sp);
+        return;
+    }
+
+    while(remainder >= steps) {
+        remainder -= steps;
+        sp->wrap.revs++;
+    }
+
+    while(remainder < 0) {
+        remainder += steps;
+        sp->wrap.revs--;
+    }
+
+    sp->wrap.position = position;
+    sp->wrap.remainder = remainder;
+}
+
+// Returns the wrapped position in steps, rounded and with the sign of the position relative to the offset.
+static int32_t wrap_position (stepper_spindle_t *sp)
+{
+    int64_t remainder = sp->wrap.remainder, half = (1LL << sp->rev.shift) >> 1;
+
+    if(sp->wrap.revs < 0 && remainder)
+        remainder -= (int64_t)sp->rev.steps;
+
+    return (int32_t)((remainder + (remainder < 0 ? -half : half)) / (1LL << sp->rev.shift));
+}
+
+static void spindle_stopped (stepper_spindle_t *sp)
+{
+    if(sp->reversal.pending)
+        reverse_direction(sp);
+
+    else if(sp->stopping) {
+
+        sp->stopping = sp->running = sp->orienting = false;
+        if(!is_running())
+            step_timer_stop();
+        hal.stepper.enable(steppers_enabled, false);
+
+        if(hal.stepper.claim_motor && settings.stepper_spindle_flags.allow_axis_control) {
+
+            hal.stepper.claim_motor(sp->axis_idx, false);
+
+            if(settings.stepper_spindle_flags.sync_position) {
+
+                spindle_ptrs_t *spindle;
+
+                if((spindle = spindle_get(sp->id)) && spindle->get_data) {
+                    wrap_update(sp);
+                    sys.position[sp->axis_idx] = wrap_position(sp);
                     sync_position();
                 }
             }
@@ -98,161 +477,530 @@ static void onSpindleStopped (void *data)
 
 static void onExecuteRealtime (uint_fast16_t state)
 {
-    st2_motor_run(motor);
+    uint_fast8_t idx;
+    stepper_spindle_t *sp;
+
+    for(idx = 0; idx < N_STEPPER_SPINDLE; idx++) {
+        if((sp = &stepper_spindle[idx])->motor) {
+            if(poll && !step_timer && !st2_motor_run(sp->motor) && sp->reversal.pending && !st2_motor_running(sp->motor))
+                reverse_direction(sp);
+            if(sp->running && settings.stepper_spindle_flags.sync_position)
+                wrap_update(sp);
+            revolutions_poll(sp);
+        }
+    }
 
     on_execute_realtime(state);
 }
 
 static void onExecuteDelay (uint_fast16_t state)
 {
-    st2_motor_run(motor);
+    if(!step_timer)
+        onStepTimer(NULL);
 
     on_execute_delay(state);
 }
 
 static void spindleUpdateRPM (spindle_ptrs_t *spindle, float rpm)
 {
-    UNUSED(spindle);
+    stepper_spindle_t *sp;
+
+    if((sp = get_spindle(spindle)) == NULL)
+        return;
 
-    spindle_data.rpm = rpm;
-    st2_motor_set_speed(motor, rpm);
+    sp->spindle_data.rpm = rpm;
+    if(!sp->orienting)
+        motor_set_speed(sp, rpm);
 }
 
 // Start or stop spindle
 static void spindleSetState (spindle_ptrs_t *spindle, spindle_state_t state, float rpm)
 {
-    UNUSED(spindle);
+    stepper_spindle_t *sp;
+
+    if((sp = get_spindle(spindle)) == NULL)
+        return;
+
+    bool orienting = sp->orienting;
+
+    sp->orienting = false;
 
     if(state.on) {
 
         if(rpm > 0.0f) {
-            running = true;
-            stopping = false;
+            if(!is_running())
+                step_timer_start();
+            sp->running = true;
+            sp->stopping = false;
         }
 
         hal.stepper.enable(steppers_enabled, false);
 
         if(hal.stepper.claim_motor)
-            hal.stepper.claim_motor(axis_idx, true);
-
-        if(st2_motor_running(motor)) {
-            if(state.ccw != spindle_data.state_programmed.ccw) {
-                st2_motor_stop(motor);
-                while(st2_motor_running(motor)) {
-                	if(on_execute_realtime)
-                		onExecuteRealtime(state_get());
-                	// else run main loop?
+            hal.stepper.claim_motor(sp->axis_idx, true);
+
+        if(st2_motor_running(sp->motor)) {
+            if(orienting || sp->reversal.pending || state.ccw != sp->spindle_data.state_programmed.ccw) {
+                // Decelerate, direction is reversed and motor accelerated from the stopped callback.
+                // Returns immediately, at speed is not signalled until the motor cruises in the new direction.
+                sp->reversal.ccw = state.ccw;
+                sp->reversal.rpm = rpm;
+                if(!sp->reversal.pending) {
+                    sp->reversal.pending = true;
+                    if(!motor_stop(sp))
+                        reverse_direction(sp);
                 }
-                st2_motor_move(motor, state.ccw ? -1.0f : 1.0f, rpm, Stepper2_InfiniteSteps);
             } else
-                st2_motor_set_speed(motor, rpm);
+                motor_set_speed(sp, rpm);
         } else {
-            if(settings.stepper_spindle_flags.sync_position)
-                st2_set_position(motor, ((int64_t)sys.position[axis_idx]) * cfactor + offset);
-            st2_motor_move(motor, state.ccw ? -1.0f : 1.0f, rpm, Stepper2_InfiniteSteps);
+            sp->reversal.pending = false;
+            if(settings.stepper_spindle_flags.sync_position) {
+                motor_update_begin(sp);
+                st2_set_position(sp->motor, ((int64_t)sys.position[sp->axis_idx]) * sp->cfactor + sp->offset);
+                motor_update_end(sp);
+                wrap_sync(sp);
+            }
+            motor_start(sp, state.ccw, rpm);
         }
-    } else
-        stopping = st2_motor_stop(motor);
+    } else {
+        sp->reversal.pending = false;
+        sp->stopping = motor_stop(sp);
+    }
 
-    spindle_set_at_speed_range(spindle, &spindle_data, rpm);
+    spindle_set_at_speed_range(spindle, &sp->spindle_data, rpm);
 
-    spindle_data.state_programmed.on = state.on;
-    spindle_data.state_programmed.ccw = state.ccw;
+    sp->spindle_data.state_programmed.on = state.on;
+    sp->spindle_data.state_programmed.ccw = state.ccw;
 }
 
 static bool spindleConfig (spindle_ptrs_t *spindle)
 {
-    if(spindle == NULL)
+    stepper_spindle_t *sp;
+
+    if(spindle == NULL || (sp = get_spindle(spindle)) == NULL)
         return false;
 
-    return st2_motor_bind_spindle(axis_idx, &motor_settings);
+    bool ok;
+
+    motor_update_begin(sp);
+    ok = st2_motor_bind_spindle(sp->axis_idx, &sp->motor_settings);
+    motor_update_end(sp);
+
+    return ok;
 }
 
-static spindle_data_t *spindleGetData (spindle_data_request_t request)
+// Revolution count and position within the revolution is tracked incrementally from the step count,
+// a division is only needed after a reset or if more than a few revolutions has passed since last update.
+static void revolutions_sync (stepper_spindle_t *sp, rev_count_t *count, uint32_t position)
 {
-    uint32_t position = (uint32_t)llabs(st2_get_position(motor) - eoffset);
+    uint64_t total = (uint64_t)position << sp->rev.shift;
+
+    count->position = position;
+    count->index = (uint32_t)(total / sp->rev.steps);
+    count->remainder = total - (uint64_t)count->index * sp->rev.steps;
+}
+
+static void revolutions_calc (stepper_spindle_t *sp, rev_count_t *count, uint32_t position)
+{
+    if(position == count->position)
+        return;
+
+    int64_t remainder = (int64_t)count->remainder + (((int64_t)position - (int64_t)count->position) * (1LL << sp->rev.shift));
+
+    if(remainder >= 0 && remainder < (int64_t)(sp->rev.steps << 2)) {
+        while(remainder >= (int64_t)sp->rev.steps) {
+            remainder -= sp->rev.steps;
+            count->index++;
+        }
+    } else if(remainder < 0 && remainder > -(int64_t)(sp->rev.steps << 2)) {
+        while(remainder < 0) {
+            remainder += sp->rev.steps;
+            count->index--;
+        }
+    } else {
+        revolutions_sync(sp, count, position);
+        return;
+    }
+
+    count->position = position;
+    count->remainder = (uint64_t)remainder;
+}
+
+// Only called from the foreground process. The new count is written to the unpublished buffer
+// so that spindle data requests from interrupt context always see a consistent count.
+static void revolutions_update (stepper_spindle_t *sp, uint32_t position, bool sync)
+{
+    rev_count_t *count = &sp->rev.count[sp->rev.current ^ 1];
+
+    *count = sp->rev.count[sp->rev.current];
+
+    if(sync)
+        revolutions_sync(sp, count, position);
+    else
+        revolutions_calc(sp, count, position);
+
+    sp->rev.current ^= 1;
+}
+
+static void revolutions_cfg (stepper_spindle_t *sp, float steps_per_rev)
+{
+    float ftmp;
+
+    if(modff(steps_per_rev, &ftmp) == 0.0f) {
+        sp->rev.shift = 0;
+        sp->rev.steps = (uint64_t)steps_per_rev;
+    } else {
+        sp->rev.shift = 16;
+        sp->rev.steps = (uint64_t)llroundf(steps_per_rev * 65536.0f);
+    }
+
+    if(sp->rev.steps == 0)
+        sp->rev.steps = 1;
+
+    sp->rev.fraction_scale = 1.0f / (float)sp->rev.steps;
+
+    revolutions_update(sp, sp->rev.count[sp->rev.current].position, true);
+    wrap_sync(sp);
+}
+
+// Keeps the published revolution count current so that spindle data requests are cheap.
+static void revolutions_poll (stepper_spindle_t *sp)
+{
+    if(sp->running) {
+        int64_t pos = st2_get_position(sp->motor) - sp->eoffset;
+        revolutions_update(sp, (uint32_t)(pos < 0 ? -pos : pos), false);
+    }
+}
+
+static spindle_data_t *spindleGetData (stepper_spindle_t *sp, spindle_data_request_t request)
+{
+    int64_t pos = st2_get_position(sp->motor) - sp->eoffset;
+    uint32_t position = (uint32_t)(pos < 0 ? -pos : pos);
+    rev_count_t count = sp->rev.count[sp->rev.current]; // may be called from interrupt context, work on a snapshot
 
     switch(request) {
 
         case SpindleData_Counters:
-            spindle_data.index_count = (uint32_t)floorf((float)position / motor_settings.steps_per_mm);
-            spindle_data.pulse_count = position;
+            revolutions_calc(sp, &count, position);
+            sp->spindle_data.index_count = count.index;
+            sp->spindle_data.pulse_count = position;
             break;
 
         case SpindleData_RPM:
-            spindle_data.rpm = st2_get_speed(motor);
+            sp->spindle_data.rpm = st2_get_speed(sp->motor);
             break;
 
         case SpindleData_AngularPosition:
-            spindle_data.angular_position = (float)position / motor_settings.steps_per_mm;
+            revolutions_calc(sp, &count, position);
+            sp->spindle_data.angular_position = (float)count.index + (float)count.remainder * sp->rev.fraction_scale;
             break;
 
         case SpindleData_AtSpeed:
-            spindle_data.state_programmed.at_speed = running ? st2_motor_cruising(motor) : !running;
+            sp->spindle_data.state_programmed.at_speed = sp->running ? motor_cruising(sp) : !sp->running;
             break;
     }
 
-    return &spindle_data;
+    return &sp->spindle_data;
+}
+
+static void spindleDataReset (stepper_spindle_t *sp)
+{
+    sp->offset = st2_get_position(sp->motor);
+    sp->eoffset = sp->offset - sp->offset % (int64_t)sp->motor_settings.steps_per_mm;
+
+    revolutions_update(sp, (uint32_t)(sp->offset - sp->eoffset < 0 ? sp->eoffset - sp->offset : sp->offset - sp->eoffset), true);
+
+    sp->wrap.position = sp->offset;
+    sp->wrap.revs = 0;
+    sp->wrap.remainder = 0;
+}
+
+// Spindle data and motor stopped callbacks has no context argument, these are provided per instance.
+
+static spindle_data_t *spindleGetData0 (spindle_data_request_t request)
+{
+    return spindleGetData(&stepper_spindle[0], request);
+}
+
+static void spindleDataReset0 (void)
+{
+    spindleDataReset(&stepper_spindle[0]);
+}
+
+static void onSpindleStopped0 (void *data)
+{
+    spindle_stopped(&stepper_spindle[0]);
+}
+
+#if N_STEPPER_SPINDLE > 1
+
+static spindle_data_t *spindleGetData1 (spindle_data_request_t request)
+{
+    return spindleGetData(&stepper_spindle[1], request);
+}
+
+static void spindleDataReset1 (void)
+{
+    spindleDataReset(&stepper_spindle[1]);
 }
 
-static void spindleDataReset (void)
+static void onSpindleStopped1 (void *data)
 {
-    offset = st2_get_position(motor);
-    eoffset = offset - offset % (int64_t)motor_settings.steps_per_mm;
+    spindle_stopped(&stepper_spindle[1]);
 }
 
+#endif
+
+static const struct {
+    uint8_t ref_id;
+    const char *name;
+    spindle_get_data_ptr get_data;
+    spindle_reset_data_ptr reset_data;
+    foreign_task_ptr on_stopped;
+} instance[N_STEPPER_SPINDLE] = {
+    { SPINDLE_STEPPER, "Stepper", spindleGetData0, spindleDataReset0, onSpindleStopped0 },
+#if N_STEPPER_SPINDLE > 1
+    { SPINDLE_STEPPER2, "Stepper 2", spindleGetData1, spindleDataReset1, onSpindleStopped1 }
+#endif
+};
+
 // Returns spindle state in a spindle_state_t variable
 static spindle_state_t spindleGetState (spindle_ptrs_t *spindle)
 {
     spindle_state_t state = {0};
+    stepper_spindle_t *sp;
 
-    UNUSED(spindle);
+    if((sp = get_spindle(spindle)) == NULL)
+        return state;
 
-    state.on = spindle_data.state_programmed.on;
-    state.ccw = spindle_data.state_programmed.ccw;
+    state.on = sp->spindle_data.state_programmed.on;
+    state.ccw = sp->spindle_data.state_programmed.ccw;
     state.at_speed = spindle->get_data(SpindleData_AtSpeed)->state_programmed.at_speed;
 
     return state;
 }
 
-static void motor_cfg (axis_settings_t *cfg)
+/*
+  Spindle orientation, M19 R<angle> [P<direction>].
+
+  Angles are relative to the position at the last spindle data reset. The spindle must be stopped with M5 and the
+  motor must have come to a standstill, the move is a step move from standstill. The shortest path is taken unless
+  P1 (CW) or P2 (CCW) is commanded.
+*/
+static void spindle_orient (stepper_spindle_t *sp, float angle, orient_dir_t dir)
 {
-    memcpy(&motor_settings, cfg, sizeof(axis_settings_t));
+    if(sp->stopping || st2_motor_running(sp->motor))
+        return; // Motor started or not yet stopped since the block was validated, a step move cannot be issued.
+
+    sp->reversal.pending = false;
+    scurve_cancel(sp);
+
+    // The motor position may have been changed by axis motion while stopped, resync before calculating the distance.
+    if(settings.stepper_spindle_flags.sync_position) {
+        motor_update_begin(sp);
+        st2_set_position(sp->motor, ((int64_t)sys.position[sp->axis_idx]) * sp->cfactor + sp->offset);
+        motor_update_end(sp);
+        wrap_sync(sp);
+    }
+
+    int64_t steps = (int64_t)sp->rev.steps, distance,
+            position = ((st2_get_position(sp->motor) - sp->eoffset) * (1LL << sp->rev.shift)) % steps;
+
+    // Distances are scaled as sp->rev.steps until the final conversion to steps.
+    if(position < 0)
+        position += steps;
+
+    distance = (int64_t)llroundf(angle * (float)steps / 360.0f) - position;
+
+    switch(dir) {
+
+        case Orient_CW:
+            if(distance < 0)
+                distance += steps;
+            break;
+
+        case Orient_CCW:
+            if(distance > 0)
+                distance -= steps;
+            break;
+
+        default:
+            if(distance > steps / 2)
+                distance -= steps;
+            else if(distance < -steps / 2)
+                distance += steps;
+            break;
+    }
+
+    distance = (distance + (distance < 0 ? -1 : 1) * ((1LL << sp->rev.shift) >> 1)) / (1LL << sp->rev.shift);
+
+    if(distance == 0)
+        return;
+
+    if(!is_running())
+        step_timer_start();
+
+    sp->ccw = distance < 0;
+    sp->running = sp->stopping = sp->orienting = true;
+
+    hal.stepper.enable(steppers_enabled, false);
+    if(hal.stepper.claim_motor)
+        hal.stepper.claim_motor(sp->axis_idx, true);
+
+    motor_update_begin(sp);
+    st2_motor_move(sp->motor, (float)distance, STEPPER_SPINDLE_ORIENT_RPM, Stepper2_Steps);
+    motor_update_end(sp);
+}
+
+// Returns the selected spindle if it is a bound stepper spindle.
+static stepper_spindle_t *get_selected (void)
+{
+    spindle_ptrs_t *spindle;
+
+    return (spindle = spindle_get(0)) ? get_spindle(spindle) : NULL;
+}
+
+static user_mcode_type_t mcode_check (user_mcode_t mcode)
+{
+    return mcode == Spindle_Orient ? UserMCode_Normal : (user_mcode.check ? user_mcode.check(mcode) : UserMCode_Unsupported);
+}
+
+static status_code_t mcode_validate (parser_block_t *gc_block)
+{
+    status_code_t state = Status_OK;
+
+    if(gc_block->user_mcode == Spindle_Orient) {
+
+        stepper_spindle_t *sp;
+
+        if((sp = get_selected()) == NULL)
+            state = Status_GcodeUnsupportedCommand;
+        else if(sp->spindle_data.state_programmed.on || sp->stopping || st2_motor_running(sp->motor))
+            state = Status_InvalidStatement; // M5 must be programmed first and the motor must have stopped
+        else if(!gc_block->words.r || isnan(gc_block->values.r))
+            state = Status_GcodeValueWordMissing;
+        else if(gc_block->values.r < 0.0f || gc_block->values.r >= 360.0f)
+            state = Status_GcodeValueOutOfRange;
+        else if(gc_block->words.p && !(isintf(gc_block->values.p) && gc_block->values.p >= (float)Orient_Shortest && gc_block->values.p <= (float)Orient_CCW))
+            state = Status_GcodeValueOutOfRange;
+
+        if(state == Status_OK) {
+            if(!gc_block->words.p)
+                gc_block->values.p = (float)Orient_Shortest;
+            gc_block->words.r = gc_block->words.p = Off;
+            gc_block->user_mcode_sync = On;
+        }
+
+    } else
+        state = Status_Unhandled;
+
+    return state == Status_Unhandled && user_mcode.validate ? user_mcode.validate(gc_block) : state;
+}
+
+static void mcode_execute (sys_state_t state, parser_block_t *gc_block)
+{
+    stepper_spindle_t *sp;
+
+    if(gc_block->user_mcode == Spindle_Orient) {
+        if((sp = get_selected()))
+            spindle_orient(sp, gc_block->values.r, (orient_dir_t)gc_block->values.p);
+    } else if(user_mcode.execute)
+        user_mcode.execute(state, gc_block);
+}
+
+static void motor_cfg (stepper_spindle_t *sp)
+{
+    memcpy(&sp->motor_settings, &settings.axis[sp->axis_idx], sizeof(axis_settings_t));
 
     if(settings.stepper_spindle_flags.cfg_as_rotary) {
-        cfactor = 360ULL;
-        motor_settings.steps_per_mm *= 360.0f;
+        sp->cfactor = 360ULL;
+        sp->motor_settings.steps_per_mm *= 360.0f;
     } else
-        cfactor = 1ULL;
+        sp->cfactor = 1ULL;
+
+    // Acceleration is stored per min^2, jerk setting is per sec^3.
+    sp->scurve.accel_max = sp->motor_settings.acceleration / 60.0f;
+    sp->scurve.jerk = sp->scurve.accel_max > 0.0f ? stepper_config.jerk * 60.0f : 0.0f;
+
+    revolutions_cfg(sp, sp->motor_settings.steps_per_mm);
+}
+
+static void motors_cfg (void)
+{
+    uint_fast8_t idx = N_STEPPER_SPINDLE;
+
+    do {
+        if(stepper_spindle[--idx].motor)
+            motor_cfg(&stepper_spindle[idx]);
+    } while(idx);
+}
+
+// Binds the motors to the configured axes, changing the binding requires a reboot.
+static void motors_bind (void)
+{
+    uint_fast8_t idx;
+    stepper_spindle_t *sp;
+
+    for(idx = 0; idx < N_STEPPER_SPINDLE; idx++) {
+
+        if((sp = &stepper_spindle[idx])->motor)
+            continue;
+
+        sp->axis_idx = Z_AXIS + 1 + stepper_config.axis[idx];
+
+        if(sp->axis_idx >= N_AXIS || (idx && stepper_spindle[0].motor && sp->axis_idx == stepper_spindle[0].axis_idx) ||
+            !(sp->motor = st2_motor_init(sp->axis_idx, true))) {
+            task_run_on_startup(report_warning, idx ? "Stepper spindle 2 has been disabled!" : "Stepper spindle has been disabled!");
+            continue;
+        }
+
+        sp->axis_mask = 1 << sp->axis_idx;
+        st2_motor_register_stopped_callback(sp->motor, instance[idx].on_stopped);
+
+        if((poll = st2_motor_poll(sp->motor)) && on_execute_delay == NULL) {
+            on_execute_delay = grbl.on_execute_delay;
+            grbl.on_execute_delay = onExecuteDelay;
+        }
+    }
+
+    motors_cfg();
 }
 
 static void settingsChanged (settings_t *settings, settings_changed_flags_t changed)
 {
+    uint_fast8_t idx;
+    stepper_spindle_t *sp;
+    spindle_ptrs_t *spindle;
+
     settings_changed(settings, changed);
 
-    spindle_ptrs_t *spindle = spindle_get_hal(spindle_id, SpindleHAL_Configured);
+    for(idx = 0; idx < N_STEPPER_SPINDLE; idx++) {
+
+        if((sp = &stepper_spindle[idx])->motor == NULL || (spindle = spindle_get_hal(sp->id, SpindleHAL_Configured)) == NULL)
+            continue;
 
-    if(changed.spindle || spindle->rpm_max != settings->axis[axis_idx].max_rate) {
+        if(changed.spindle || spindle->rpm_max != settings->axis[sp->axis_idx].max_rate) {
 
-        spindle_ptrs_t *spindle_hal;
+            spindle_ptrs_t *spindle_hal;
 
-        spindle->rpm_min = 0.0f;
-        spindle->rpm_max = settings->axis[axis_idx].max_rate;
-        spindle->at_speed_tolerance = settings->spindle.at_speed_tolerance;
-        spindle_data.at_speed_enabled = settings->spindle.at_speed_tolerance > 0.0f;
+            spindle->rpm_min = 0.0f;
+            spindle->rpm_max = settings->axis[sp->axis_idx].max_rate;
+            spindle->at_speed_tolerance = settings->spindle.at_speed_tolerance;
+            sp->spindle_data.at_speed_enabled = settings->spindle.at_speed_tolerance > 0.0f;
 
-        if((spindle_hal = spindle_get_hal(spindle_id, SpindleHAL_Active))) {
-            spindle_hal->rpm_min = spindle->rpm_min;
-            spindle_hal->rpm_max = spindle->rpm_max;
-            spindle_hal->at_speed_tolerance = spindle->at_speed_tolerance;
+            if((spindle_hal = spindle_get_hal(sp->id, SpindleHAL_Active))) {
+                spindle_hal->rpm_min = spindle->rpm_min;
+                spindle_hal->rpm_max = spindle->rpm_max;
+                spindle_hal->at_speed_tolerance = spindle->at_speed_tolerance;
+            }
         }
-    }
 
-    if(motor && hal.stepper.claim_motor) {
-        if(!settings->stepper_spindle_flags.allow_axis_control)
-            hal.stepper.claim_motor(axis_idx, true);
-        else if(!running)
-            hal.stepper.claim_motor(axis_idx, false);
+        if(hal.stepper.claim_motor) {
+            if(!settings->stepper_spindle_flags.allow_axis_control)
+                hal.stepper.claim_motor(sp->axis_idx, true);
+            else if(!sp->running)
+                hal.stepper.claim_motor(sp->axis_idx, false);
+        }
     }
 }
 
@@ -260,7 +1008,16 @@ static void settingsChanged (settings_t *settings, settings_changed_flags_t chan
 
 static void esp32_spindle_off (spindle_ptrs_t *spindle)
 {
-    stopping = st2_motor_stop(motor);
+    stepper_spindle_t *sp;
+
+    if((sp = get_spindle(spindle)) == NULL)
+        return;
+
+    sp->reversal.pending = false;
+    scurve_cancel(sp);
+    motor_update_begin(sp);
+    sp->stopping = st2_motor_stop(sp->motor);
+    motor_update_end(sp);
 }
 
 #endif
@@ -276,37 +1033,60 @@ PROGMEM static const setting_descr_t spindle_setting_descr[] = {
     }
 };
 
+PROGMEM static const setting_detail_t plugin_setting_detail[] = {
+    { Setting_StepperSpindle_Jerk, Group_Spindle, "Stepper spindle jerk", "rev/sec^3", Format_Decimal, "#####0.0", NULL, NULL, Setting_NonCore, &stepper_config.jerk, NULL, NULL },
+    { Setting_StepperSpindle_StepTimer, Group_Spindle, "Stepper spindle step timer", "kHz", Format_Int8, "##0", "0", "100", Setting_NonCore, &stepper_config.step_timer_khz, NULL, NULL, { .reboot_required = On } },
+    { Setting_StepperSpindle_Axis, Group_Spindle, "Stepper spindle axis", NULL, Format_RadioButtons, STEPPER_SPINDLE_AXES, NULL, NULL, Setting_NonCore, &stepper_config.axis[0], NULL, NULL, { .reboot_required = On } },
+#if N_STEPPER_SPINDLE > 1
+    { Setting_StepperSpindle2_Axis, Group_Spindle, "Stepper spindle 2 axis", NULL, Format_RadioButtons, STEPPER_SPINDLE_AXES, NULL, NULL, Setting_NonCore, &stepper_config.axis[1], NULL, NULL, { .reboot_required = On } }
+#endif
+};
+
+PROGMEM static const setting_descr_t plugin_setting_descr[] = {
+    { Setting_StepperSpindle_Jerk, "Jerk limit for S-curve acceleration of the stepper spindle, set to 0 for trapezoidal acceleration.\\n"
+                                   "Acceleration is capped by the acceleration setting of the bound axis."
+    },
+    { Setting_StepperSpindle_StepTimer, "Frequency of the hardware timer used for step generation when the driver uses polling, set to 0 to poll from the main loop.\\n"
+                                        "Ignored if the driver generates steps from interrupts or no timer is available."
+    },
+    { Setting_StepperSpindle_Axis, "Axis the stepper spindle motor is bound to." },
+#if N_STEPPER_SPINDLE > 1
+    { Setting_StepperSpindle2_Axis, "Axis the second stepper spindle motor is bound to, must differ from the first." }
+#endif
+};
+
 static void _settings_restore (void)
 {
     // NOOP
 }
 
-static void _settings_load (void)
+static void plugin_settings_save (void)
 {
-    motor_cfg(&settings.axis[axis_idx]);
+    hal.nvs.memcpy_to_nvs(nvs_address, (uint8_t *)&stepper_config, sizeof(stepper_spindle_settings_t), true);
+
+    motors_cfg();
 }
 
-static void onSettingsSave (void)
+static void plugin_settings_restore (void)
 {
-    if(settings.stepper_spindle_flags.cfg_as_rotary != (cfactor == 360ULL)) {
+    uint_fast8_t idx = N_STEPPER_SPINDLE;
 
-        if(settings.stepper_spindle_flags.cfg_as_rotary) {
-            settings.axis[axis_idx].steps_per_mm /= 360.0f;
-            settings.axis[axis_idx].max_rate = roundf(settings.axis[axis_idx].max_rate * 360.0f);
-        } else {
-            settings.axis[axis_idx].steps_per_mm = roundf(settings.axis[axis_idx].steps_per_mm * 360.0f);
-            settings.axis[axis_idx].max_rate = roundf(settings.axis[axis_idx].max_rate / 360.0f);
-        }
+    stepper_config.jerk = 0.0f;
+    stepper_config.step_timer_khz = 0;
 
-        motor_cfg(&settings.axis[axis_idx]);
-    }
+    // Default to the highest numbered axes, first spindle to the highest.
+    do {
+        idx--;
+        stepper_config.axis[idx] = N_AXIS - Z_AXIS - 2 - idx;
+    } while(idx);
 
-    settings_save();
+    hal.nvs.memcpy_to_nvs(nvs_address, (uint8_t *)&stepper_config, sizeof(stepper_spindle_settings_t), true);
 }
 
-void stepper_spindle_init (void)
+// Registers the instances that are bound to a motor, a failed binding leaves the instance unregistered.
+static void spindles_register (void)
 {
-    PROGMEM static const spindle_ptrs_t spindle = {
+    PROGMEM static const spindle_ptrs_t spindle_base = {
         .type = SpindleType_Stepper,
         .ref_id = SPINDLE_STEPPER,
         .cap = {
@@ -322,11 +1102,90 @@ void stepper_spindle_init (void)
 #ifdef GRBL_ESP32
         .esp32_off = esp32_spindle_off,
 #endif
-        .get_data = spindleGetData,
-        .reset_data = spindleDataReset,
+        .get_data = spindleGetData0,
+        .reset_data = spindleDataReset0,
         .update_rpm = spindleUpdateRPM
     };
 
+    static spindle_ptrs_t spindle[N_STEPPER_SPINDLE];
+
+    uint_fast8_t idx;
+    stepper_spindle_t *sp;
+
+    for(idx = 0; idx < N_STEPPER_SPINDLE; idx++) {
+
+        if((sp = &stepper_spindle[idx])->motor == NULL || sp->id != -1)
+            continue;
+
+        memcpy(&spindle[idx], &spindle_base, sizeof(spindle_ptrs_t));
+        spindle[idx].ref_id = instance[idx].ref_id;
+        spindle[idx].get_data = instance[idx].get_data;
+        spindle[idx].reset_data = instance[idx].reset_data;
+
+        if((sp->id = spindle_register(&spindle[idx], instance[idx].name)) == -1) {
+            sp->motor = NULL;
+            task_run_on_startup(report_warning, idx ? "Stepper spindle 2 has been disabled!" : "Stepper spindle has been disabled!");
+        }
+    }
+}
+
+// Spindle data is provided by the selected instance.
+static void onSpindleSelected (spindle_ptrs_t *spindle)
+{
+    uint_fast8_t idx = N_STEPPER_SPINDLE;
+
+    do {
+        if(stepper_spindle[--idx].motor && stepper_spindle[idx].id == spindle->id) {
+            hal.spindle_data.get = instance[idx].get_data;
+            hal.spindle_data.reset = instance[idx].reset_data;
+        }
+    } while(idx);
+
+    if(on_spindle_selected)
+        on_spindle_selected(spindle);
+}
+
+static void plugin_settings_load (void)
+{
+    if(hal.nvs.memcpy_from_nvs((uint8_t *)&stepper_config, nvs_address, sizeof(stepper_spindle_settings_t), true) != NVS_TransferResult_OK)
+        plugin_settings_restore();
+
+    motors_bind();
+    spindles_register();
+    step_timer_claim();
+}
+
+static void _settings_load (void)
+{
+    motors_cfg();
+}
+
+static void onSettingsSave (void)
+{
+    uint_fast8_t idx;
+    stepper_spindle_t *sp;
+
+    for(idx = 0; idx < N_STEPPER_SPINDLE; idx++) {
+
+        if((sp = &stepper_spindle[idx])->motor == NULL || settings.stepper_spindle_flags.cfg_as_rotary == (sp->cfactor == 360ULL))
+            continue;
+
+        if(settings.stepper_spindle_flags.cfg_as_rotary) {
+            settings.axis[sp->axis_idx].steps_per_mm /= 360.0f;
+            settings.axis[sp->axis_idx].max_rate = roundf(settings.axis[sp->axis_idx].max_rate * 360.0f);
+        } else {
+            settings.axis[sp->axis_idx].steps_per_mm = roundf(settings.axis[sp->axis_idx].steps_per_mm * 360.0f);
+            settings.axis[sp->axis_idx].max_rate = roundf(settings.axis[sp->axis_idx].max_rate / 360.0f);
+        }
+
+        motor_cfg(sp);
+    }
+
+    settings_save();
+}
+
+void stepper_spindle_init (void)
+{
     static setting_details_t setting_details = {
         .is_core = true,
         .settings = spindle_setting_detail,
@@ -338,23 +1197,31 @@ void stepper_spindle_init (void)
         .restore = _settings_restore
     };
 
-    if((motor = st2_motor_init(axis_idx, true)) && (spindle_id = spindle_register(&spindle, "Stepper")) != -1) {
-
-        settings_register(&setting_details);
+    static setting_details_t plugin_setting_details = {
+        .settings = plugin_setting_detail,
+        .n_settings = sizeof(plugin_setting_detail) / sizeof(setting_detail_t),
+        .descriptions = plugin_setting_descr,
+        .n_descriptions = sizeof(plugin_setting_descr) / sizeof(setting_descr_t),
+        .save = plugin_settings_save,
+        .load = plugin_settings_load,
+        .restore = plugin_settings_restore
+    };
 
-        if(st2_motor_poll(motor)) {
+    // Motors are bound to axes and the spindles registered when the plugin settings are loaded.
+    if((nvs_address = nvs_alloc(sizeof(stepper_spindle_settings_t)))) {
 
-            on_execute_realtime = grbl.on_execute_realtime;
-            grbl.on_execute_realtime = onExecuteRealtime;
+        uint_fast8_t idx = N_STEPPER_SPINDLE;
 
-            on_execute_delay = grbl.on_execute_delay;
-            grbl.on_execute_delay = onExecuteDelay;
-        }
+        do {
+            stepper_spindle[--idx].id = -1;
+            stepper_spindle[idx].rev.steps = 1;
+        } while(idx);
 
-        hal.spindle_data.get = spindleGetData;
-        hal.spindle_data.reset = spindleDataReset;
+        settings_register(&setting_details);
+        settings_register(&plugin_setting_details);
 
-        st2_motor_register_stopped_callback(motor, onSpindleStopped);
+        on_execute_realtime = grbl.on_execute_realtime;
+        grbl.on_execute_realtime = onExecuteRealtime;
 
         stepper_enable = hal.stepper.enable;
         hal.stepper.enable = stepperEnable;
@@ -364,6 +1231,15 @@ void stepper_spindle_init (void)
 
         settings_save = settings_claim_save(onSettingsSave);
 
+        memcpy(&user_mcode, &grbl.user_mcode, sizeof(user_mcode_ptrs_t));
+
+        grbl.user_mcode.check = mcode_check;
+        grbl.user_mcode.validate = mcode_validate;
+        grbl.user_mcode.execute = mcode_execute;
+
+        on_spindle_selected = grbl.on_spindle_selected;
+        grbl.on_spindle_selected = onSpindleSelected;
+
     } else
         task_run_on_startup(report_warning, "Stepper spindle has been disabled!");
 }
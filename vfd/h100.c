@@ -30,17 +30,15 @@
 
 #include "spindle.h"
 
-static float rpm2f_factor = 5.0f * 2.0f / 60.0f; // 2 poles
+// Q16.16 factors for RPM <-> Hz * 10 conversions, f = rpm * poles / 12. Default is 2 poles.
+static vfd_q16_t rpm2f_q16 = (2 * VFD_Q16_ONE + 6) / 12, f2rpm_q16 = 12 * VFD_Q16_ONE / 2;
 static uint32_t modbus_address, freq_min = 0, freq_max = 0, exceptions = 0;
+static uint16_t amps = 0, amps_max = 0;
 static spindle_id_t spindle_id = -1;
 static spindle_ptrs_t *spindle_hal = NULL;
 static spindle_state_t spindle_state = {0};
 static spindle_data_t spindle_data = {0};
 static vfd_state_t vfd_state;
-static on_spindle_selected_ptr on_spindle_selected;
-static on_report_options_ptr on_report_options;
-static settings_changed_ptr settings_changed;
-static driver_reset_ptr driver_reset;
 
 static void rx_packet (modbus_message_t *msg);
 static void rx_exception (uint8_t code, void *context);
@@ -52,7 +50,28 @@ static const modbus_callbacks_t callbacks = {
     .on_rx_exception = rx_exception
 };
 
-// Read min and max configured frequency from spindle
+// Status poll frame, output frequency and output current (A * 10) are read together. Written to when sent, see vfd_poll().
+static modbus_message_t poll_cmd = {
+    .context = (void *)VFD_GetRPM,
+    .crc_check = false,
+    .adu[1] = ModBus_ReadInputRegisters,
+    .adu[2] = 0x00,
+    .adu[3] = 0x00,
+    .adu[4] = 0x00,
+    .adu[5] = 0x03,
+    .tx_length = 8,
+    .rx_length = 11
+};
+
+static void set_poles (uint16_t poles)
+{
+    if(poles) {
+        rpm2f_q16 = vfd_q16_factor((float)poles, 12.0f);
+        f2rpm_q16 = vfd_q16_factor(12.0f, (float)poles);
+    }
+}
+
+// Read poles, rated current and min and max configured frequency from spindle
 static void get_rpm_range (void *data)
 {
     bool ok;
@@ -74,25 +93,32 @@ static void get_rpm_range (void *data)
         cmd.adu[3] = 11; // F011
     }
 
-    if(ok && modbus_send(&cmd, &callbacks, true)) {
-
+    if(ok && (ok = modbus_send(&cmd, &callbacks, true))) {
         cmd.context = (void *)VFD_GetMaxRPM;
         cmd.adu[3] = 5; // F005
+    }
+
+    if(ok && modbus_send(&cmd, &callbacks, true)) {
+
+        cmd.context = (void *)VFD_GetMaxAmps;
+        cmd.adu[3] = 142; // F142, rated current * 10
 
         modbus_send(&cmd, &callbacks, true);
     }
 }
 
-static void set_rpm (float rpm, bool block)
+static bool set_rpm (float rpm, bool block)
 {
     static uint8_t busy = 0;
 
     if(busy && !block)
-        return;
+        return false;
+
+    bool ok = true;
 
     if(rpm != spindle_data.rpm_programmed) {
 
-        uint16_t freq = (uint16_t)(rpm * rpm2f_factor);
+        uint32_t freq = vfd_q16_scale(vfd_rpm_to_uint(rpm), rpm2f_q16);
 
         freq = min(max(freq, freq_min), freq_max);
 
@@ -110,10 +136,12 @@ static void set_rpm (float rpm, bool block)
         };
 
         busy++;
-        modbus_send(&rpm_cmd, &callbacks, block);
+        ok = modbus_send(&rpm_cmd, &callbacks, block);
         spindle_set_at_speed_range(spindle_hal, &spindle_data, rpm);
         busy--;
     }
+
+    return ok;
 }
 
 static void spindleUpdateRPM (spindle_ptrs_t *spindle, float rpm)
@@ -156,8 +184,7 @@ static void spindleSetState (spindle_ptrs_t *spindle, spindle_state_t state, flo
     spindle_state.on = state.on;
     spindle_state.ccw = state.ccw;
 
-    if(modbus_send(&mode_cmd, &callbacks, true))
-        set_rpm(rpm, true);
+    vfd_send_runstop(state.on && rpm != 0.0f, rpm, &mode_cmd, &callbacks, set_rpm);
 
     busy = false;
 }
@@ -170,34 +197,26 @@ static spindle_state_t spindleGetState (spindle_ptrs_t *spindle)
     if(vfd_state != VFD_Ready)
         return spindle_state;
 
-    modbus_message_t mode_cmd = {
-        .context = (void *)VFD_GetRPM,
-        .crc_check = false,
-        .adu[0] = modbus_address,
-        .adu[1] = ModBus_ReadInputRegisters,
-        .adu[2] = 0x00,
-        .adu[3] = 0x00,
-        .adu[4] = 0x00,
-        .adu[5] = 0x02,
-        .tx_length = 8,
-        .rx_length = 9
-    };
-
-    modbus_send(&mode_cmd, &callbacks, false);
+    vfd_poll(&poll_cmd, &callbacks);
 
     spindle_state.at_speed = spindle->get_data(SpindleData_AtSpeed)->state_programmed.at_speed;
 
     return spindle_state; // return previous state as we do not want to wait for the response
 }
 
+static float spindleGetLoad (void)
+{
+    return amps_max ? (float)amps * 100.0f / (float)amps_max : 0.0f;
+}
+
 static spindle_data_t *spindleGetData (spindle_data_request_t request)
 {
     return &spindle_data;
 }
 
-static float f2rpm (uint16_t f)
+static inline float f2rpm (uint16_t f)
 {
-    return (float)f / rpm2f_factor;
+    return (float)vfd_q16_scale(f, f2rpm_q16);
 }
 
 static void rx_packet (modbus_message_t *msg)
@@ -208,11 +227,16 @@ static void rx_packet (modbus_message_t *msg)
 
             case VFD_GetRPM:
                 exceptions = 0;
+                amps = (msg->adu[7] << 8) | msg->adu[8]; // A * 10
                 spindle_validate_at_speed(spindle_data, f2rpm((msg->adu[3] << 8) | msg->adu[4]));
                 break;
 
+            case VFD_GetMaxAmps:
+                amps_max = (msg->adu[3] << 8) | msg->adu[4]; // A * 10
+                break;
+
             case VFD_GetPoles:
-                rpm2f_factor = 5.0f * (float)msg->adu[4] / 60.0f;
+                set_poles(msg->adu[4]);
                 break;
 
             case VFD_GetMinRPM:
@@ -235,24 +259,22 @@ static void rx_packet (modbus_message_t *msg)
 
 static void rx_exception (uint8_t code, void *context)
 {
-    if((vfd_response_t)context != VFD_GetRPM || ++exceptions == VFD_ASYNC_EXCEPTION_LEVEL) {
+    // Rated current is only used for load reporting, do not fail if the drive does not support reading it.
+    if((vfd_response_t)context == VFD_GetMaxAmps)
+        amps_max = 0;
+    else if((vfd_response_t)context != VFD_GetRPM || ++exceptions == VFD_ASYNC_EXCEPTION_LEVEL) {
         exceptions = 0;
         vfd_failed(false);
     }
 }
 
-static void onReportOptions (bool newopt)
+static void onReportOptions (void)
 {
-    on_report_options(newopt);
-
-    if(!newopt)
-        report_plugin("H-100 VFD", "0.11");
+    report_plugin("H-100 VFD", "0.13");
 }
 
 static void onDriverReset (void)
 {
-    driver_reset();
-
     if(spindle_hal)
         task_run_on_reset(get_rpm_range, NULL);
 }
@@ -264,27 +286,23 @@ static bool spindleConfig (spindle_ptrs_t *spindle)
 
 static void onSpindleSelected (spindle_ptrs_t *spindle)
 {
-    if(spindle->id == spindle_id) {
+    if(spindle) {
 
         spindle_data.rpm_programmed = -1.0f;
         vfd_atspeed_configure((spindle_hal = spindle), &spindle_data);
 
         modbus_set_silence(NULL);
         modbus_address = vfd_get_modbus_address(spindle_id);
+        poll_cmd.adu[0] = modbus_address;
 
         get_rpm_range(NULL);
 
     } else
         spindle_hal = NULL;
-
-    if(on_spindle_selected)
-        on_spindle_selected(spindle);
 }
 
 static void settingsChanged (settings_t *settings, settings_changed_flags_t changed)
 {
-    settings_changed(settings, changed);
-
     if(changed.spindle)
         spindle_get_hal(spindle_id, SpindleHAL_Configured)->at_speed_tolerance = vfd_atspeed_configure(spindle_hal, &spindle_data);
 }
@@ -306,23 +324,17 @@ void vfd_h100_init (void)
             .get_state = spindleGetState,
             .update_rpm = spindleUpdateRPM,
             .get_data = spindleGetData,
+        },
+        .vfd = {
+            .get_load = spindleGetLoad,
+            .on_selected = onSpindleSelected,
+            .settings_changed = settingsChanged,
+            .report_options = onReportOptions,
+            .on_reset = onDriverReset
         }
     };
 
-    if((spindle_id = vfd_register(&vfd, "H-100")) != -1) {
-
-        on_spindle_selected = grbl.on_spindle_selected;
-        grbl.on_spindle_selected = onSpindleSelected;
-
-        settings_changed = hal.settings_changed;
-        hal.settings_changed = settingsChanged;
-
-        on_report_options = grbl.on_report_options;
-        grbl.on_report_options = onReportOptions;
-
-        driver_reset = hal.driver_reset;
-        hal.driver_reset = onDriverReset;
-    }
+    spindle_id = vfd_register(&vfd, "H-100");
 }
 
 #endif
@@ -30,18 +30,15 @@
 
 #include "spindle.h"
 
-static uint32_t modbus_address, exceptions = 0;
-static float amps = 0.0f, amps_max = 0.0f, rpm_at_50Hz = 0.0f;
+static uint32_t modbus_address, rpm_at_50Hz = 0, exceptions = 0;
+static uint16_t amps = 0, amps_max = 0;
+static vfd_q16_t f2rpm_q16 = 0, rpm2f_q16 = 0;
 static spindle_id_t spindle_id = -1;
 static spindle_ptrs_t *spindle_hal = NULL;
 static spindle_state_t spindle_state = {0};
 static spindle_data_t spindle_data = {0};
 static vfd_state_t vfd_state;
 
-static on_report_options_ptr on_report_options;
-static on_spindle_selected_ptr on_spindle_selected;
-static settings_changed_ptr settings_changed;
-static driver_reset_ptr driver_reset;
 
 static void rx_packet (modbus_message_t *msg);
 static void rx_exception (uint8_t code, void *context);
@@ -64,6 +61,35 @@ static const modbus_callbacks_t callbacks = {
     .on_rx_exception = rx_exception
 };
 
+// Status poll frames, address is set when the spindle is selected. Written to when sent, see vfd_poll().
+static modbus_message_t poll_cmd = {
+    .context = (void *)VFD_GetRPM,
+    .crc_check = false,
+    .adu[1] = ModBus_ReadInputRegisters,
+    .adu[2] = 0x03,
+    .adu[3] = 0x01,
+    .tx_length = 8,
+    .rx_length = 8
+};
+
+static modbus_message_t amps_cmd = {
+    .context = (void *)VFD_GetAmps,
+    .crc_check = false,
+    .adu[1] = ModBus_ReadInputRegisters,
+    .adu[2] = 0x03,
+    .adu[3] = 0x02,     // Output amps * 10
+    .tx_length = 8,
+    .rx_length = 8
+};
+
+// Precompute Q16.16 factors for RPM <-> Hz * 100 conversions, frequency is set and reported in 0.01 Hz units.
+static void set_rpm_at_50Hz (uint32_t rpm)
+{
+    rpm_at_50Hz = rpm;
+    f2rpm_q16 = vfd_q16_factor((float)rpm, 5000.0f);
+    rpm2f_q16 = vfd_q16_factor(5000.0f, (float)rpm);
+}
+
 // Read maximum configured RPM from spindle, value is used later for calculating current RPM
 // In the case of the original Huanyang protocol, the value is the configured RPM at 50Hz
 static void get_rpm_range (void)
@@ -80,7 +106,7 @@ static void get_rpm_range (void)
         .rx_length = 8
     };
 
-    rpm_at_50Hz = 0.0f;
+    rpm_at_50Hz = 0;
 
     if(modbus_send(&cmd, &callbacks, true)) {
 
@@ -94,8 +120,8 @@ static void get_rpm_range (void)
         }
     }
 
-    if(rpm_at_50Hz == 0.0f)
-        rpm_at_50Hz = 3000.0f;
+    if(rpm_at_50Hz == 0)
+        set_rpm_at_50Hz(3000);
 }
 
 // Read maximum configured current from spindle, value is used later for calculating spindle load
@@ -117,16 +143,18 @@ static void get_max_amps (void)
     modbus_send(&cmd, &callbacks, true);
 }
 
-static void set_rpm (float rpm, bool block)
+static bool set_rpm (float rpm, bool block)
 {
     static uint8_t busy = 0;
 
     if(busy && !block)
-        return;
+        return false;
+
+    bool ok = true;
 
-    if(rpm_at_50Hz != 0.0f && rpm != spindle_data.rpm_programmed) {
+    if(rpm2f_q16 && rpm != spindle_data.rpm_programmed) {
 
-        uint32_t data = lroundf(rpm * 5000.0f / rpm_at_50Hz); // send Hz * 10  (Ex:1500 RPM = 25Hz .... Send 2500)
+        uint32_t data = vfd_q16_scale(vfd_rpm_to_uint(rpm), rpm2f_q16); // send Hz * 100  (Ex:1500 RPM = 25Hz .... Send 2500)
 
         modbus_message_t rpm_cmd = {
             .context = (void *)VFD_SetRPM,
@@ -141,10 +169,12 @@ static void set_rpm (float rpm, bool block)
         };
 
         busy++;
-        modbus_send(&rpm_cmd, &callbacks, block);
+        ok = modbus_send(&rpm_cmd, &callbacks, block);
         spindle_set_at_speed_range(spindle_hal, &spindle_data, rpm);
         busy--;
     }
+
+    return ok;
 }
 
 static void spindleUpdateRPM (spindle_ptrs_t *spindle, float rpm)
@@ -186,8 +216,7 @@ static void spindleSetState (spindle_ptrs_t *spindle, spindle_state_t state, flo
     spindle_state.on = spindle_data.state_programmed.on = state.on;
     spindle_state.ccw = spindle_data.state_programmed.ccw = state.ccw;
 
-    if(modbus_send(&mode_cmd, &callbacks, true))
-        set_rpm(rpm, true);
+    vfd_send_runstop(state.on && rpm != 0.0f, rpm, &mode_cmd, &callbacks, set_rpm);
 
     busy = false;
 }
@@ -198,31 +227,10 @@ static spindle_state_t spindleGetState (spindle_ptrs_t *spindle)
     if(vfd_state != VFD_Ready)
         return spindle_state;
 
-    modbus_message_t rpm_cmd = {
-        .context = (void *)VFD_GetRPM,
-        .crc_check = false,
-        .adu[0] = modbus_address,
-        .adu[1] = ModBus_ReadInputRegisters,
-        .adu[2] = 0x03,
-        .adu[3] = 0x01,
-        .tx_length = 8,
-        .rx_length = 8
-    };
-
-    modbus_send(&rpm_cmd, &callbacks, false); // TODO: add flag for not raising alarm?
+    vfd_poll(&poll_cmd, &callbacks);
 
-    modbus_message_t amps_cmd = {
-        .context = (void *)VFD_GetAmps,
-        .crc_check = false,
-        .adu[0] = modbus_address,
-        .adu[1] = ModBus_ReadInputRegisters,
-        .adu[2] = 0x03,
-        .adu[3] = 0x02,     // Output amps * 10
-        .tx_length = 8,
-        .rx_length = 8
-    };
-
-    modbus_send(&amps_cmd, &callbacks, false); // TODO: add flag for not raising alarm?
+    if(vfd_poll_due(VFD_AMPS_DECIMATION))
+        vfd_poll(&amps_cmd, &callbacks);
 
     spindle_state.at_speed = spindle->get_data(SpindleData_AtSpeed)->state_programmed.at_speed;
 
@@ -237,33 +245,32 @@ static void rx_packet (modbus_message_t *msg)
 
             case VFD_GetRPM:
                 exceptions = 0;
-                spindle_validate_at_speed(spindle_data, (float)((msg->adu[4] << 8) | msg->adu[5]) * rpm_at_50Hz / 5000.0f);
+                spindle_validate_at_speed(spindle_data, (float)vfd_q16_scale((msg->adu[4] << 8) | msg->adu[5], f2rpm_q16));
                 break;
 
             case VFD_GetMinRPM:
-                if(rpm_at_50Hz != 0.0f)
-                    spindle_hal->rpm_min = (float)((msg->adu[4] << 8) | msg->adu[5]) * rpm_at_50Hz / 5000.0f;
+                if(f2rpm_q16)
+                    spindle_hal->rpm_min = (float)vfd_q16_scale((msg->adu[4] << 8) | msg->adu[5], f2rpm_q16);
                 break;
 
             case VFD_GetMaxRPM:
-                if(rpm_at_50Hz != 0.0f) {
+                if(f2rpm_q16) {
                     spindle_hal->cap.rpm_range_locked = On;
-                    spindle_hal->rpm_max = (float)((msg->adu[4] << 8) | msg->adu[5]) * rpm_at_50Hz / 5000.0f;
+                    spindle_hal->rpm_max = (float)vfd_q16_scale((msg->adu[4] << 8) | msg->adu[5], f2rpm_q16);
                 }
                 vfd_state = VFD_Ready;
                 break;
 
             case VFD_GetRPMAt50Hz:
-                if(spindle_hal)
-                    rpm_at_50Hz = (float)((msg->adu[4] << 8) | msg->adu[5]);
+                set_rpm_at_50Hz((msg->adu[4] << 8) | msg->adu[5]);
                 break;
 
             case VFD_GetMaxAmps:
-                amps_max = (float)((msg->adu[4] << 8) | msg->adu[5]) / 10.0f;
+                amps_max = (msg->adu[4] << 8) | msg->adu[5]; // A * 10
                 break;
 
             case VFD_GetAmps:
-                amps = (float)((msg->adu[4] << 8) | msg->adu[5]) / 10.0f;
+                amps = (msg->adu[4] << 8) | msg->adu[5]; // A * 10
                 break;
 
             default:
@@ -279,7 +286,7 @@ static bool spindleConfig (spindle_ptrs_t *spindle)
 
 static float spindleGetLoad (void)
 {
-    return amps_max ? (amps / amps_max) * 100.0f : 0.0f;
+    return amps_max ? (float)amps * 100.0f / (float)amps_max : 0.0f;
 }
 
 static spindle_data_t *spindleGetData (spindle_data_request_t request)
@@ -295,12 +302,9 @@ static void rx_exception (uint8_t code, void *context)
     }
 }
 
-static void onReportOptions (bool newopt)
+static void onReportOptions (void)
 {
-    on_report_options(newopt);
-
-    if(!newopt)
-        report_plugin("HUANYANG VFD", "0.20");
+    report_plugin("HUANYANG VFD", "0.21");
 }
 
 static void after_reset (void *data)
@@ -311,36 +315,30 @@ static void after_reset (void *data)
 
 static void onDriverReset (void)
 {
-    driver_reset();
-
     if(spindle_hal)
         task_run_on_reset(after_reset, NULL);
 }
 
 static void onSpindleSelected (spindle_ptrs_t *spindle)
 {
-    if(spindle->id == spindle_id) {
+    if(spindle) {
 
         spindle_data.rpm_programmed = -1.0f;
         vfd_atspeed_configure((spindle_hal = spindle), &spindle_data);
 
         modbus_set_silence(&silence);
         modbus_address = vfd_get_modbus_address(spindle_id);
+        poll_cmd.adu[0] = amps_cmd.adu[0] = modbus_address;
 
         get_rpm_range();
         get_max_amps();
 
     } else
         spindle_hal = NULL;
-
-    if(on_spindle_selected)
-        on_spindle_selected(spindle);
 }
 
 static void settingsChanged (settings_t *settings, settings_changed_flags_t changed)
 {
-    settings_changed(settings, changed);
-
     if(changed.spindle)
         spindle_get_hal(spindle_id, SpindleHAL_Configured)->at_speed_tolerance = vfd_atspeed_configure(spindle_hal, &spindle_data);
 }
@@ -363,23 +361,16 @@ void vfd_huanyang_init (void)
             .update_rpm = spindleUpdateRPM,
             .get_data = spindleGetData,
         },
-        .vfd.get_load = spindleGetLoad
+        .vfd = {
+            .get_load = spindleGetLoad,
+            .on_selected = onSpindleSelected,
+            .settings_changed = settingsChanged,
+            .report_options = onReportOptions,
+            .on_reset = onDriverReset
+        }
     };
 
-    if((spindle_id = vfd_register(&vfd, "Huanyang v1")) != -1) {
-
-        on_spindle_selected = grbl.on_spindle_selected;
-        grbl.on_spindle_selected = onSpindleSelected;
-
-        settings_changed = hal.settings_changed;
-        hal.settings_changed = settingsChanged;
-
-        on_report_options = grbl.on_report_options;
-        grbl.on_report_options = onReportOptions;
-
-        driver_reset = hal.driver_reset;
-        hal.driver_reset = onDriverReset;
-    }
+    spindle_id = vfd_register(&vfd, "Huanyang v1");
 }
 
 #endif
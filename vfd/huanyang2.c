@@ -31,16 +31,13 @@
 #include "spindle.h"
 
 static uint32_t modbus_address, rpm_max = 0, exceptions = 0;
+static vfd_q16_t rpm2f_q16 = 0;
 static spindle_id_t spindle_id = -1;
 static spindle_ptrs_t *spindle_hal = NULL;
 static spindle_state_t spindle_state = {0};
 static spindle_data_t spindle_data = {0};
 static vfd_state_t vfd_state;
 
-static on_report_options_ptr on_report_options;
-static on_spindle_selected_ptr on_spindle_selected;
-static settings_changed_ptr settings_changed;
-static driver_reset_ptr driver_reset;
 
 static void rx_exception (uint8_t code, void *context);
 static void rx_packet (modbus_message_t *msg);
@@ -52,6 +49,19 @@ static const modbus_callbacks_t callbacks = {
     .on_rx_exception = rx_exception
 };
 
+// Status poll frame, address is set when the spindle is selected. Written to when sent, see vfd_poll().
+static modbus_message_t poll_cmd = {
+    .context = (void *)VFD_GetRPM,
+    .crc_check = false,
+    .adu[1] = ModBus_ReadHoldingRegisters,
+    .adu[2] = 0x70,
+    .adu[3] = 0x0C,
+    .adu[4] = 0x00,
+    .adu[5] = 0x02,
+    .tx_length = 8,
+    .rx_length = 8
+};
+
 // Read maximum configured RPM from spindle, value is used later for calculating current RPM
 // In the case of the original Huanyang protocol, the value is the configured RPM at 50Hz
 static void get_rpm_max (void *data)
@@ -72,16 +82,18 @@ static void get_rpm_max (void *data)
     modbus_send(&cmd, &callbacks, true);
 }
 
-static void set_rpm (float rpm, bool block)
+static bool set_rpm (float rpm, bool block)
 {
     static uint8_t busy = 0;
 
     if(busy && !block)
-        return;
+        return false;
 
-    if(rpm_max && rpm != spindle_data.rpm_programmed) {
+    bool ok = true;
 
-        uint16_t data = (uint32_t)(rpm) * 10000UL / rpm_max;
+    if(rpm2f_q16 && rpm != spindle_data.rpm_programmed) {
+
+        uint16_t data = vfd_q16_scale(vfd_rpm_to_uint(rpm), rpm2f_q16); // 0.01% of max
 
         modbus_message_t rpm_cmd = {
             .context = (void *)VFD_SetRPM,
@@ -96,10 +108,12 @@ static void set_rpm (float rpm, bool block)
         };
 
         busy++;
-        modbus_send(&rpm_cmd, &callbacks, block);
+        ok = modbus_send(&rpm_cmd, &callbacks, block);
         spindle_set_at_speed_range(spindle_hal, &spindle_data, rpm);
         busy--;
     }
+
+    return ok;
 }
 
 static void spindleUpdateRPM (spindle_ptrs_t *spindle, float rpm)
@@ -141,8 +155,7 @@ static void spindleSetState (spindle_ptrs_t *spindle, spindle_state_t state, flo
     spindle_state.on = spindle_data.state_programmed.on = state.on;
     spindle_state.ccw = spindle_data.state_programmed.ccw = state.ccw;
 
-    if(modbus_send(&mode_cmd, &callbacks, true))
-        set_rpm(rpm, true);
+    vfd_send_runstop(state.on && rpm != 0.0f, rpm, &mode_cmd, &callbacks, set_rpm);
 
     busy = false;
 }
@@ -155,20 +168,7 @@ static spindle_state_t spindleGetState (spindle_ptrs_t *spindle)
     if(vfd_state != VFD_Ready)
         return spindle_state;
 
-    modbus_message_t mode_cmd = {
-        .context = (void *)VFD_GetRPM,
-        .crc_check = false,
-        .adu[0] = modbus_address,
-        .adu[1] = ModBus_ReadHoldingRegisters,
-        .adu[2] = 0x70,
-        .adu[3] = 0x0C,
-        .adu[4] = 0x00,
-        .adu[5] = 0x02,
-        .tx_length = 8,
-        .rx_length = 8
-    };
-
-    modbus_send(&mode_cmd, &callbacks, false); // TODO: add flag for not raising alarm?
+    vfd_poll(&poll_cmd, &callbacks);
 
     spindle_state.at_speed = spindle->get_data(SpindleData_AtSpeed)->state_programmed.at_speed;
 
@@ -188,6 +188,7 @@ static void rx_packet (modbus_message_t *msg)
 
             case VFD_GetMaxRPM:
                 rpm_max = (msg->adu[4] << 8) | msg->adu[5];
+                rpm2f_q16 = vfd_q16_factor(10000.0f, (float)rpm_max);
                 //if(spindle_hal) {
                 //    spindle_hal->cap.rpm_range_locked = On;
                 //    spindle_hal->rpm_max = rpm_max50 = (float)((msg->adu[4] << 8) | msg->adu[5]);
@@ -219,44 +220,35 @@ static void rx_exception (uint8_t code, void *context)
     }
 }
 
-static void onReportOptions (bool newopt)
+static void onReportOptions (void)
 {
-    on_report_options(newopt);
-
-    if(!newopt)
-        report_plugin("HUANYANG P2A VFD", "0.18");
+    report_plugin("HUANYANG P2A VFD", "0.19");
 }
 
 static void onDriverReset (void)
 {
-    driver_reset();
-
     if(spindle_hal)
         task_run_on_reset(get_rpm_max, NULL);
 }
 
 static void onSpindleSelected (spindle_ptrs_t *spindle)
 {
-    if(spindle->id == spindle_id) {
+    if(spindle) {
 
         spindle_data.rpm_programmed = -1.0f;
         vfd_atspeed_configure((spindle_hal = spindle), &spindle_data);
 
         modbus_address = vfd_get_modbus_address(spindle_id);
+        poll_cmd.adu[0] = modbus_address;
 
         get_rpm_max(NULL);
 
     } else
         spindle_hal = NULL;
-
-    if(on_spindle_selected)
-        on_spindle_selected(spindle);
 }
 
 static void settingsChanged (settings_t *settings, settings_changed_flags_t changed)
 {
-    settings_changed(settings, changed);
-
     if(changed.spindle)
         spindle_get_hal(spindle_id, SpindleHAL_Configured)->at_speed_tolerance = vfd_atspeed_configure(spindle_hal, &spindle_data);
 }
@@ -277,24 +269,17 @@ void vfd_huanyang2_init (void)
             .set_state = spindleSetState,
             .get_state = spindleGetState,
             .update_rpm = spindleUpdateRPM,
-            .get_data = spindleGetData,
+            .get_data = spindleGetData
+        },
+        .vfd = {
+            .on_selected = onSpindleSelected,
+            .settings_changed = settingsChanged,
+            .report_options = onReportOptions,
+            .on_reset = onDriverReset
         }
     };
 
-    if((spindle_id = vfd_register(&vfd, "Huanyang P2A")) != -1) {
-
-        on_spindle_selected = grbl.on_spindle_selected;
-        grbl.on_spindle_selected = onSpindleSelected;
-
-        settings_changed = hal.settings_changed;
-        hal.settings_changed = settingsChanged;
-
-        on_report_options = grbl.on_report_options;
-        grbl.on_report_options = onReportOptions;
-
-        driver_reset = hal.driver_reset;
-        hal.driver_reset = onDriverReset;
-    }
+    spindle_id = vfd_register(&vfd, "Huanyang P2A");
 }
 
 #endif
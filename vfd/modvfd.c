@@ -34,15 +34,17 @@
 #include "spindle.h"
 
 static uint32_t modbus_address, exceptions = 0;
+static uint16_t amps = 0, amps_max = 0;
+static uint8_t freq_offset, amps_offset;
+static modbus_message_t poll_cmd, amps_cmd; // Status poll frames, built by configure_poll() and written to when sent
+static bool rw_unsupported = false, rw_block;
+static uint16_t rw_freq;
 static spindle_id_t spindle_id;
 static spindle_ptrs_t *spindle_hal;
 static spindle_state_t spindle_state = {0};
 static spindle_data_t spindle_data = {0};
 static vfd_state_t vfd_state;
 
-static on_spindle_selected_ptr on_spindle_selected;
-static on_report_options_ptr on_report_options;
-static settings_changed_ptr settings_changed;
 
 static void rx_packet (modbus_message_t *msg);
 static void rx_exception (uint8_t code, void *context);
@@ -61,32 +63,174 @@ static bool spindleConfig (spindle_ptrs_t *spindle)
     return modbus_isup().rtu;
 }
 
-static void set_rpm (float rpm, bool block)
+static inline modbus_function_t read_function (void)
+{
+    return modvfd_config.options.read_input_regs ? ModBus_ReadInputRegisters : ModBus_ReadHoldingRegisters;
+}
+
+// Builds a read request for count registers, returns the message.
+static modbus_message_t *read_cmd (modbus_message_t *cmd, vfd_response_t context, uint16_t reg, uint16_t count)
+{
+    cmd->context = (void *)context;
+    cmd->crc_check = false;
+    cmd->adu[0] = modbus_address;
+    cmd->adu[1] = read_function();
+    cmd->adu[2] = reg >> 8;
+    cmd->adu[3] = reg & 0xFF;
+    cmd->adu[4] = count >> 8;
+    cmd->adu[5] = count & 0xFF;
+    cmd->tx_length = 8;
+    cmd->rx_length = 5 + count * 2;
+
+    return cmd;
+}
+
+// Builds a write request for count (1 or 2) consecutive registers, returns the message.
+static modbus_message_t *write_cmd (modbus_message_t *cmd, vfd_response_t context, uint16_t reg, uint16_t data0, uint16_t data1, uint_fast8_t count)
+{
+    cmd->context = (void *)context;
+    cmd->crc_check = false;
+    cmd->adu[0] = modbus_address;
+    cmd->adu[2] = reg >> 8;
+    cmd->adu[3] = reg & 0xFF;
+    cmd->rx_length = 8;
+
+    if(count == 1 && !modvfd_config.options.write_multiple) {
+        cmd->adu[1] = ModBus_WriteRegister;
+        cmd->adu[4] = data0 >> 8;
+        cmd->adu[5] = data0 & 0xFF;
+        cmd->tx_length = 8;
+    } else {
+        cmd->adu[1] = ModBus_WriteRegisters;
+        cmd->adu[4] = 0x00;
+        cmd->adu[5] = count;
+        cmd->adu[6] = count * 2;
+        cmd->adu[7] = data0 >> 8;
+        cmd->adu[8] = data0 & 0xFF;
+        if(count == 2) {
+            cmd->adu[9] = data1 >> 8;
+            cmd->adu[10] = data1 & 0xFF;
+        }
+        cmd->tx_length = 9 + count * 2;
+    }
+
+    return cmd;
+}
+
+// Builds a combined frequency write and status read request (0x17), the read part is the status poll.
+static modbus_message_t *read_write_cmd (modbus_message_t *cmd, uint16_t freq)
+{
+    cmd->context = (void *)VFD_SetRPM;
+    cmd->crc_check = false;
+    cmd->adu[0] = modbus_address;
+    cmd->adu[1] = MODVFD_ReadWriteRegisters;
+    cmd->adu[2] = poll_cmd.adu[2];
+    cmd->adu[3] = poll_cmd.adu[3];
+    cmd->adu[4] = poll_cmd.adu[4];
+    cmd->adu[5] = poll_cmd.adu[5];
+    cmd->adu[6] = vfd_config.set_freq_reg >> 8;
+    cmd->adu[7] = vfd_config.set_freq_reg & 0xFF;
+    cmd->adu[8] = 0x00;
+    cmd->adu[9] = 0x01;
+    cmd->adu[10] = 0x02;
+    cmd->adu[11] = freq >> 8;
+    cmd->adu[12] = freq & 0xFF;
+    cmd->tx_length = 15;
+    cmd->rx_length = poll_cmd.rx_length;
+
+    return cmd;
+}
+
+// Output current is only polled when the max (rated) current register is set, it is needed for calculating spindle load.
+static inline bool poll_amps (void)
+{
+    return modvfd_config.amps_reg && modvfd_config.max_amps_reg;
+}
+
+// Frequency and output current are read in one frame if enabled and the registers are close enough.
+// The status poll frames are built here, called when the spindle is selected and on settings changes.
+static void configure_poll (void)
+{
+    uint16_t first, last, poll_reg, poll_count;
+
+    poll_reg = vfd_config.get_freq_reg;
+    poll_count = 1;
+    freq_offset = 3;
+    amps_offset = 0;
+
+    if(poll_amps() && modvfd_config.options.poll_amps) {
+
+        first = min(vfd_config.get_freq_reg, modvfd_config.amps_reg);
+        last = max(vfd_config.get_freq_reg, modvfd_config.amps_reg);
+
+        if(last - first < MODVFD_MAX_POLL_REGS) {
+            poll_reg = first;
+            poll_count = last - first + 1;
+            freq_offset = 3 + (vfd_config.get_freq_reg - first) * 2;
+            amps_offset = 3 + (modvfd_config.amps_reg - first) * 2;
+        }
+    }
+
+    read_cmd(&poll_cmd, VFD_GetRPM, poll_reg, poll_count);
+    read_cmd(&amps_cmd, VFD_GetAmps, modvfd_config.amps_reg, 1);
+
+    rw_unsupported = false;
+}
+
+static inline bool combined_write (void)
+{
+    return modvfd_config.options.combined_write &&
+            vfd_config.set_freq_reg == vfd_config.runstop_reg + 1 &&
+             MODBUS_MAX_ADU_SIZE >= 13;
+}
+
+// Cleared on an illegal function exception response, set_rpm() then reverts to a plain write.
+static inline bool read_write (void)
+{
+    return modvfd_config.options.read_write && !rw_unsupported && MODBUS_MAX_ADU_SIZE >= 15;
+}
+
+// Read maximum (rated) current from the drive, value is used later for calculating spindle load
+static void get_max_amps (void)
+{
+    modbus_message_t cmd;
+
+    amps_max = 0;
+
+    if(poll_amps())
+        modbus_send(read_cmd(&cmd, VFD_GetMaxAmps, modvfd_config.max_amps_reg, 1), &callbacks, true);
+}
+
+static bool set_rpm (float rpm, bool block)
 {
     static uint8_t busy = 0;
 
     if(busy && !block)
-        return;
+        return false;
 
-    uint16_t data = ((uint32_t)(rpm)) / vfd_config.in_divider * vfd_config.in_multiplier;
-
-    modbus_message_t rpm_cmd = {
-        .context = (void *)VFD_SetRPM,
-        .crc_check = false,
-        .adu[0] = modbus_address,
-        .adu[1] = ModBus_WriteRegister,
-        .adu[2] = vfd_config.set_freq_reg >> 8,
-        .adu[3] = vfd_config.set_freq_reg & 0xFF,
-        .adu[4] = data >> 8,
-        .adu[5] = data & 0xFF,
-        .tx_length = 8,
-        .rx_length = 8
-    };
+    bool ok, rw = read_write();
+    modbus_message_t rpm_cmd;
+    uint16_t freq = vfd_q16_scale(vfd_rpm_to_uint(rpm), vfd_scaling.rpm2f);
+
+    if(rw) {
+        rw_freq = freq;
+        rw_block = block;
+        read_write_cmd(&rpm_cmd, freq);
+    } else
+        write_cmd(&rpm_cmd, VFD_SetRPM, vfd_config.set_freq_reg, freq, 0, 1);
 
     busy++;
-    modbus_send(&rpm_cmd, &callbacks, block);
+    ok = modbus_send(&rpm_cmd, &callbacks, block);
+
+    // Drive does not support the combined request, the exception handler has disabled it. Retry with a plain write
+    // so that the caller gets the result of the frequency write, e.g. before sending the run command.
+    if(!ok && rw && block && rw_unsupported)
+        ok = modbus_send(write_cmd(&rpm_cmd, VFD_SetRPM, vfd_config.set_freq_reg, freq, 0, 1), &callbacks, true);
+
     spindle_set_at_speed_range(spindle_hal, &spindle_data, rpm);
     busy--;
+
+    return ok;
 }
 
 static void spindleUpdateRPM (spindle_ptrs_t *spindle, float rpm)
@@ -106,26 +250,15 @@ static void spindleSetState (spindle_ptrs_t *spindle, spindle_state_t state, flo
     if(busy)
         return;
 
+    bool on = state.on && rpm != 0.0f;
     uint16_t runstop;
+    modbus_message_t mode_cmd;
 
-    if(!state.on || rpm == 0.0f)
+    if(!on)
         runstop = vfd_config.stop_cmd;
     else
         runstop = state.ccw ? vfd_config.run_ccw_cmd : vfd_config.run_cw_cmd;
 
-    modbus_message_t mode_cmd = {
-        .context = (void *)VFD_SetStatus,
-        .crc_check = true,
-        .adu[0] = modbus_address,
-        .adu[1] = ModBus_WriteRegister,
-        .adu[2] = vfd_config.runstop_reg >> 8,
-        .adu[3] = vfd_config.runstop_reg & 0xFF,
-        .adu[4] = runstop >> 8,
-        .adu[5] = runstop & 0xFF,
-        .tx_length = 8,
-        .rx_length = 8
-    };
-
     busy = true;
 
     if(spindle_state.ccw != state.ccw)
@@ -134,8 +267,16 @@ static void spindleSetState (spindle_ptrs_t *spindle, spindle_state_t state, flo
     spindle_state.on = spindle_data.state_programmed.on = state.on;
     spindle_state.ccw = spindle_data.state_programmed.ccw = state.ccw;
 
-    if(modbus_send(&mode_cmd, &callbacks, true))
-        set_rpm(rpm, true);
+    if(on && combined_write()) {
+        write_cmd(&mode_cmd, VFD_SetStatus, vfd_config.runstop_reg, runstop, vfd_q16_scale(vfd_rpm_to_uint(rpm), vfd_scaling.rpm2f), 2);
+        mode_cmd.crc_check = true;
+        if(modbus_send(&mode_cmd, &callbacks, true))
+            spindle_set_at_speed_range(spindle_hal, &spindle_data, rpm);
+    } else {
+        write_cmd(&mode_cmd, VFD_SetStatus, vfd_config.runstop_reg, runstop, 0, 1);
+        mode_cmd.crc_check = true;
+        vfd_send_runstop(on, rpm, &mode_cmd, &callbacks, set_rpm);
+    }
 
     busy = false;
 }
@@ -153,29 +294,24 @@ static spindle_state_t spindleGetState (spindle_ptrs_t *spindle)
     if(vfd_state != VFD_Ready)
         return spindle_state;
 
-    modbus_message_t mode_cmd = {
-        .context = (void *)VFD_GetRPM,
-        .crc_check = false,
-        .adu[0] = modbus_address,
-        .adu[1] = ModBus_ReadHoldingRegisters,
-        .adu[2] = vfd_config.get_freq_reg >> 8,
-        .adu[3] = vfd_config.get_freq_reg & 0xFF,
-        .adu[4] = 0x00,
-        .adu[5] = 0x01,
-        .tx_length = 8,
-        .rx_length = 7
-    };
+    vfd_poll(&poll_cmd, &callbacks);
 
-    modbus_send(&mode_cmd, &callbacks, false); // TODO: add flag for not raising alarm?
+    if(poll_amps() && amps_offset == 0 && vfd_poll_due(VFD_AMPS_DECIMATION))
+        vfd_poll(&amps_cmd, &callbacks);
 
     spindle_state.at_speed = spindle->get_data(SpindleData_AtSpeed)->state_programmed.at_speed;
 
     return spindle_state; // return previous state as we do not want to wait for the response
 }
 
-static float f2rpm (uint16_t f)
+static float spindleGetLoad (void)
 {
-    return (float)f * (vfd_config.out_multiplier / vfd_config.out_divider);
+    return amps_max ? (float)amps * 100.0f / ((float)amps_max * (float)max(modvfd_config.amps_divider, 1)) : 0.0f;
+}
+
+static inline float f2rpm (uint16_t f)
+{
+    return (float)vfd_q16_scale(f, vfd_scaling.f2rpm);
 }
 
 static void rx_packet (modbus_message_t *msg)
@@ -188,9 +324,24 @@ static void rx_packet (modbus_message_t *msg)
                 vfd_state = VFD_Ready;
                 break;
 
+            case VFD_SetRPM:
+                if(msg->adu[1] != MODVFD_ReadWriteRegisters)
+                    break;
+                // fall through, the response to a combined write contains the status poll data
+
             case VFD_GetRPM:
                 exceptions = 0;
-                spindle_validate_at_speed(spindle_data, f2rpm((msg->adu[3] << 8) | msg->adu[4]));
+                spindle_validate_at_speed(spindle_data, f2rpm((msg->adu[freq_offset] << 8) | msg->adu[freq_offset + 1]));
+                if(amps_offset)
+                    amps = (msg->adu[amps_offset] << 8) | msg->adu[amps_offset + 1];
+                break;
+
+            case VFD_GetAmps:
+                amps = (msg->adu[3] << 8) | msg->adu[4];
+                break;
+
+            case VFD_GetMaxAmps:
+                amps_max = (msg->adu[3] << 8) | msg->adu[4];
                 break;
 
 //            case VFD_GetMaxRPM:
@@ -206,23 +357,33 @@ static void rx_packet (modbus_message_t *msg)
 
 static void rx_exception (uint8_t code, void *context)
 {
-    if((vfd_response_t)context != VFD_GetRPM || ++exceptions == VFD_ASYNC_EXCEPTION_LEVEL) {
+    if((vfd_response_t)context == VFD_SetRPM && code == ModBus_IllegalFunction && read_write()) {
+
+        rw_unsupported = true;
+
+        // Blocking requests are resent by set_rpm().
+        if(!rw_block) {
+            modbus_message_t rpm_cmd;
+            modbus_send(write_cmd(&rpm_cmd, VFD_SetRPM, vfd_config.set_freq_reg, rw_freq, 0, 1), &callbacks, false);
+        }
+
+        return;
+    }
+
+    if(!((vfd_response_t)context == VFD_GetRPM || (vfd_response_t)context == VFD_GetAmps) || ++exceptions == VFD_ASYNC_EXCEPTION_LEVEL) {
         exceptions = 0;
         vfd_failed(false);
     }
 }
 
-static void onReportOptions (bool newopt)
+static void onReportOptions (void)
 {
-    on_report_options(newopt);
-
-    if(!newopt)
-        report_plugin("MODVFD", "0.09");
+    report_plugin("MODVFD", "0.12");
 }
 
 static void onSpindleSelected (spindle_ptrs_t *spindle)
 {
-    if(spindle->id == spindle_id) {
+    if(spindle) {
 
         spindle_data.rpm_programmed = -1.0f;
         vfd_atspeed_configure((spindle_hal = spindle), &spindle_data);
@@ -230,21 +391,20 @@ static void onSpindleSelected (spindle_ptrs_t *spindle)
         modbus_set_silence(NULL);
         modbus_address = vfd_get_modbus_address(spindle_id);
 
-//        spindleGetMaxRPM();
+        configure_poll();
+        get_max_amps();
 
     } else
         spindle_hal = NULL;
-
-    if(on_spindle_selected)
-        on_spindle_selected(spindle);
 }
 
 static void settingsChanged (settings_t *settings, settings_changed_flags_t changed)
 {
-    settings_changed(settings, changed);
-
     if(changed.spindle)
         spindle_get_hal(spindle_id, SpindleHAL_Configured)->at_speed_tolerance = vfd_atspeed_configure(spindle_hal, &spindle_data);
+
+    if(spindle_hal)
+        configure_poll();
 }
 
 void vfd_modvfd_init (void)
@@ -264,20 +424,16 @@ void vfd_modvfd_init (void)
             .get_state = spindleGetState,
             .update_rpm = spindleUpdateRPM,
             .get_data = spindleGetData,
+        },
+        .vfd = {
+            .get_load = spindleGetLoad,
+            .on_selected = onSpindleSelected,
+            .settings_changed = settingsChanged,
+            .report_options = onReportOptions
         }
     };
 
-    if((spindle_id = vfd_register(&vfd, "MODVFD")) != -1) {
-
-        on_spindle_selected = grbl.on_spindle_selected;
-        grbl.on_spindle_selected = onSpindleSelected;
-
-        settings_changed = hal.settings_changed;
-        hal.settings_changed = settingsChanged;
-
-        on_report_options = grbl.on_report_options;
-        grbl.on_report_options = onReportOptions;
-    }
+    spindle_id = vfd_register(&vfd, "MODVFD");
 }
 
 #endif
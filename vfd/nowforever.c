@@ -32,6 +32,8 @@
 
 #include "spindle.h"
 
+// Q16.16 factors for RPM <-> Hz * 100 conversions for a 2 pole spindle.
+static const vfd_q16_t rpm2f_q16 = (100 * VFD_Q16_ONE + 30) / 60, f2rpm_q16 = (60 * VFD_Q16_ONE + 50) / 100;
 static uint32_t modbus_address, freq_min = 0, freq_max = 0, exceptions = 0;
 static spindle_id_t spindle_id;
 static spindle_ptrs_t *spindle_hal = NULL;
@@ -39,10 +41,6 @@ static spindle_data_t spindle_data = {0};
 static spindle_state_t spindle_state = {0};
 static vfd_state_t vfd_state;
 
-static on_report_options_ptr on_report_options;
-static on_spindle_selected_ptr on_spindle_selected;
-static settings_changed_ptr settings_changed;
-static driver_reset_ptr driver_reset;
 
 static void rx_packet (modbus_message_t *msg);
 static void rx_exception (uint8_t code, void *context);
@@ -54,6 +52,19 @@ static const modbus_callbacks_t callbacks = {
     .on_rx_exception = rx_exception
 };
 
+// Status poll frame, address is set when the spindle is selected. Written to when sent, see vfd_poll().
+static modbus_message_t poll_cmd = {
+    .context = (void *)VFD_GetRPM,
+    .crc_check = false,
+    .adu[1] = ModBus_ReadHoldingRegisters,
+    .adu[2] = 0x05,
+    .adu[3] = 0x02,
+    .adu[4] = 0x00,
+    .adu[5] = 0x01,
+    .tx_length = 8,
+    .rx_length = 7
+};
+
 static bool spindleConfig (spindle_ptrs_t *spindle)
 {
     return modbus_isup().rtu;
@@ -78,16 +89,18 @@ static void get_rpm_range (void *data)
     modbus_send(&cmd, &callbacks, true);
 }
 
-static void set_rpm (float rpm, bool block)
+static bool set_rpm (float rpm, bool block)
 {
     static uint8_t busy = 0;
 
     if(busy && !block)
-        return;
+        return false;
+
+    bool ok = true;
 
     if(rpm != spindle_data.rpm_programmed ) {
 
-        uint16_t freq = (uint16_t)(rpm * 1.667f); // * 100.0f / 60.0f
+        uint32_t freq = vfd_q16_scale(vfd_rpm_to_uint(rpm), rpm2f_q16); // * 100 / 60
 
         freq = min(max(freq, freq_min), freq_max);
 
@@ -108,10 +121,12 @@ static void set_rpm (float rpm, bool block)
         };
 
         busy++;
-        modbus_send(&rpm_cmd, &callbacks, block);
+        ok = modbus_send(&rpm_cmd, &callbacks, block);
         spindle_set_at_speed_range(spindle_hal, &spindle_data, rpm);
         busy--;
     }
+
+    return ok;
 }
 
 static void spindleUpdateRPM (spindle_ptrs_t *spindle, float rpm)
@@ -158,8 +173,7 @@ static void spindleSetState (spindle_ptrs_t *spindle, spindle_state_t state, flo
     spindle_state.on = state.on;
     spindle_state.ccw = state.ccw;
 
-    if(modbus_send(&mode_cmd, &callbacks, true))
-        set_rpm(rpm, true);
+    vfd_send_runstop(state.on && rpm != 0.0f, rpm, &mode_cmd, &callbacks, set_rpm);
 
     busy = false;
 }
@@ -170,20 +184,7 @@ static spindle_state_t spindleGetState (spindle_ptrs_t *spindle)
     if(vfd_state != VFD_Ready)
         return spindle_state;
 
-    modbus_message_t mode_cmd = {
-        .context = (void *)VFD_GetRPM,
-        .crc_check = false,
-        .adu[0] = modbus_address,
-        .adu[1] = ModBus_ReadHoldingRegisters,
-        .adu[2] = 0x05,
-        .adu[3] = 0x02,
-        .adu[4] = 0x00,
-        .adu[5] = 0x01,
-        .tx_length = 8,
-        .rx_length = 7
-    };
-
-    modbus_send(&mode_cmd, &callbacks, false); // TODO: add flag for not raising alarm?
+    vfd_poll(&poll_cmd, &callbacks);
 
     spindle_state.at_speed = spindle->get_data(SpindleData_AtSpeed)->state_programmed.at_speed;
 
@@ -197,7 +198,7 @@ static spindle_data_t *spindleGetData (spindle_data_request_t request)
 
 static inline float f2rpm (uint16_t f)
 {
-    return (float)f * 60.0f / 100.0f;
+    return (float)vfd_q16_scale(f, f2rpm_q16);
 }
 
 static void rx_packet (modbus_message_t *msg)
@@ -237,45 +238,36 @@ static void rx_exception (uint8_t code, void *context)
     }
 }
 
-static void onReportOptions (bool newopt)
+static void onReportOptions (void)
 {
-    on_report_options(newopt);
-
-    if(!newopt)
-        report_plugin("Nowforever VFD", "0.09");
+    report_plugin("Nowforever VFD", "0.10");
 }
 
 static void onDriverReset (void)
 {
-    driver_reset();
-
     if(spindle_hal)
         task_run_on_reset(get_rpm_range, NULL);
 }
 
 static void onSpindleSelected (spindle_ptrs_t *spindle)
 {
-    if(spindle->id == spindle_id) {
+    if(spindle) {
 
         spindle_data.rpm_programmed = -1.0f;
         vfd_atspeed_configure((spindle_hal = spindle), &spindle_data);
 
         modbus_set_silence(NULL);
         modbus_address = vfd_get_modbus_address(spindle_id);
+        poll_cmd.adu[0] = modbus_address;
 
         get_rpm_range(NULL);
 
     } else
         spindle_hal = NULL;
-
-    if(on_spindle_selected)
-        on_spindle_selected(spindle);
 }
 
 static void settingsChanged (settings_t *settings, settings_changed_flags_t changed)
 {
-    settings_changed(settings, changed);
-
     if(changed.spindle)
         spindle_get_hal(spindle_id, SpindleHAL_Configured)->at_speed_tolerance = vfd_atspeed_configure(spindle_hal, &spindle_data);
 }
@@ -297,23 +289,16 @@ void vfd_nowforever_init (void)
             .get_state = spindleGetState,
             .update_rpm = spindleUpdateRPM,
             .get_data = spindleGetData
+        },
+        .vfd = {
+            .on_selected = onSpindleSelected,
+            .settings_changed = settingsChanged,
+            .report_options = onReportOptions,
+            .on_reset = onDriverReset
         }
     };
 
-    if((spindle_id = vfd_register(&vfd, "Nowforever")) != -1) {
-
-        on_spindle_selected = grbl.on_spindle_selected;
-        grbl.on_spindle_selected = onSpindleSelected;
-
-        settings_changed = hal.settings_changed;
-        hal.settings_changed = settingsChanged;
-
-        on_report_options = grbl.on_report_options;
-        grbl.on_report_options = onReportOptions;
-
-        driver_reset = hal.driver_reset;
-        hal.driver_reset = onDriverReset;
-    }
+    spindle_id = vfd_register(&vfd, "Nowforever");
 }
 
 #endif
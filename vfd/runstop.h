@@ -0,0 +1,56 @@
+/*
+
+  vfd/runstop.h - run/stop and frequency command sequencing for VFD spindles
+
+  Part of grblHAL
+
+  Copyright (c) 2026 Terje Io
+
+  grblHAL is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  grblHAL is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with grblHAL. If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef _VFD_RUNSTOP_H_
+#define _VFD_RUNSTOP_H_
+
+#include "grbl/modbus.h"
+
+/*! \brief Pointer to the driver function that writes the output frequency.
+\param rpm programmed RPM.
+\param block true to wait for the response.
+\returns true if the frequency was written or did not need to be, false if not.
+*/
+typedef bool (*vfd_set_rpm_ptr)(float rpm, bool block);
+
+/*! \brief Send the run/stop command and the output frequency, both as blocking requests.
+
+When starting the frequency is written first so that the drive ramps directly to the target instead of
+from the previous frequency, the run command is only sent if the frequency write succeeded.
+When stopping the stop command is sent first and the frequency is only written if the stop succeeded.
+\param on true to start the drive, false to stop it.
+\param rpm programmed RPM.
+\param runstop pointer to the run/stop command frame.
+\param callbacks pointer to the \a modbus_callbacks_t struct of the driver.
+\param set_rpm pointer to the driver function that writes the output frequency.
+\returns true if both requests succeeded, false if not.
+*/
+static inline bool vfd_send_runstop (bool on, float rpm, modbus_message_t *runstop, const modbus_callbacks_t *callbacks, vfd_set_rpm_ptr set_rpm)
+{
+    if(on)
+        return set_rpm(rpm, true) && modbus_send(runstop, callbacks, true);
+
+    return modbus_send(runstop, callbacks, true) && set_rpm(rpm, true);
+}
+
+#endif
@@ -42,24 +42,61 @@
 #endif
 
 #ifndef VFD_QUERY_INTERVAL
-#define VFD_QUERY_INTERVAL 150 // ms
+#define VFD_QUERY_INTERVAL 150 // ms, load reporting
 #endif
 
+// Status poll intervals
+#ifndef VFD_QUERY_INTERVAL_RAMP
+#define VFD_QUERY_INTERVAL_RAMP 40 // ms, spindle accelerating or decelerating
+#endif
+#ifndef VFD_QUERY_INTERVAL_RUN
+#define VFD_QUERY_INTERVAL_RUN 500 // ms, spindle at speed
+#endif
+#ifndef VFD_QUERY_INTERVAL_IDLE
+#define VFD_QUERY_INTERVAL_IDLE 2000 // ms, spindle stopped
+#endif
+
+#ifndef VFD_POLL_TIMEOUT
+#define VFD_POLL_TIMEOUT ((VFD_RETRIES + 1) * (VFD_RETRY_DELAY + 50)) // ms
+#endif
+
+#define VFD_N_POLLS 4
+
 typedef struct {
     spindle_id_t id;
-    vfd_spindle_ptrs_t hal;
+    const vfd_spindle_ptrs_t *hal;
+    struct {
+        uint32_t last_request;
+        uint32_t interval;
+        uint32_t cycle;
+        spindle_state_t state;  // state returned by the last request
+    } query;
 } vfd_spindle_t;
 
+typedef struct {
+    vfd_response_t context; // VFD_Idle if slot is free
+    uint8_t address;
+    uint32_t sent;
+    const modbus_callbacks_t *callbacks;
+} vfd_poll_t;
+
 static uint8_t n_spindle = 0;
 static bool spindle_changed = false;
-static vfd_spindle_t vfd_spindle = {0}, vfd_spindles[N_SPINDLE];
-static nvs_address_t nvs_address = 0;
+static vfd_spindle_t *vfd_spindle = NULL, vfd_spindles[N_SPINDLE]; // vfd_spindle is the selected VFD spindle, NULL if none
+static nvs_address_t nvs_address = 0, modvfd_nvs_address = 0;
+static vfd_poll_t polls[VFD_N_POLLS] = {0};
+static vfd_spindle_t *vfd_query = NULL; // VFD spindle being requested for its state, see vfd_poll_due()
 
 static on_spindle_select_ptr on_spindle_select;
 static on_spindle_selected_ptr on_spindle_selected;
 static on_realtime_report_ptr on_realtime_report = NULL;
+static on_report_options_ptr on_report_options;
+static settings_changed_ptr settings_changed;
+static driver_reset_ptr driver_reset;
 
 vfd_settings_t vfd_config;
+modvfd_settings_t modvfd_config;
+vfd_scaling_t vfd_scaling;
 
 static void vfd_realtime_report (stream_write_ptr stream_write, report_tracking_flags_t report)
 {
@@ -69,12 +106,13 @@ static void vfd_realtime_report (stream_write_ptr stream_write, report_tracking_
     if(on_realtime_report)
         on_realtime_report(stream_write, report);
 
-    if(vfd_spindle.hal.vfd.get_load) {
+    if(vfd_spindle && vfd_spindle->hal->vfd.get_load) {
 
         uint32_t ms = hal.get_elapsed_ticks();
 
-        if((ms = hal.get_elapsed_ticks()) - last_request >= VFD_QUERY_INTERVAL) {
-            float new_load = vfd_spindle.hal.vfd.get_load();
+        if(ms - last_request >= VFD_QUERY_INTERVAL || report.all) {
+            last_request = ms;
+            float new_load = vfd_spindle->hal->vfd.get_load();
             if(load != new_load || spindle_changed || report.all) {
                 load = new_load;
                 spindle_changed = false;
@@ -85,6 +123,98 @@ static void vfd_realtime_report (stream_write_ptr stream_write, report_tracking_
     }
 }
 
+// The message context is the poll slot while the poll is outstanding, the driver context is restored on reception.
+
+static void poll_rx_packet (modbus_message_t *msg)
+{
+    vfd_poll_t *poll = (vfd_poll_t *)msg->context;
+
+    if(poll->context != VFD_Idle && poll->address == (uint8_t)msg->adu[0]) {
+        msg->context = (void *)poll->context;
+        poll->context = VFD_Idle;
+        if(poll->callbacks->on_rx_packet)
+            poll->callbacks->on_rx_packet(msg);
+    }
+}
+
+static void poll_rx_exception (uint8_t code, void *context)
+{
+    vfd_poll_t *poll = (vfd_poll_t *)context;
+
+    if(poll->context != VFD_Idle) {
+        context = (void *)poll->context;
+        poll->context = VFD_Idle;
+        if(poll->callbacks->on_rx_exception)
+            poll->callbacks->on_rx_exception(code, context);
+    }
+}
+
+static const modbus_callbacks_t poll_callbacks = {
+    .retries = VFD_RETRIES,
+    .retry_delay = VFD_RETRY_DELAY,
+    .on_rx_packet = poll_rx_packet,
+    .on_rx_exception = poll_rx_exception
+};
+
+/*! \brief Queue a non-blocking status poll.
+
+The poll is not queued if a poll with the same context (response type) to the same ModBus address is still
+outstanding. Outstanding polls are released when the response or the final exception is received, or after
+VFD_POLL_TIMEOUT ms if neither arrives.
+
+Drivers keep their poll frames in static storage and only set the ModBus address when the spindle is selected.
+The frames are not read-only: the ModBus layer writes the CRC into the frame when it is sent.
+\param msg pointer to a \a modbus_message_t struct, the context member must be set to a \a vfd_response_t value.
+\param callbacks pointer to the \a modbus_callbacks_t struct of the driver, retries and retry delay are always VFD_RETRIES and VFD_RETRY_DELAY.
+\returns true if the poll was queued, false if not.
+*/
+bool vfd_poll (modbus_message_t *msg, const modbus_callbacks_t *callbacks)
+{
+    uint32_t ms = hal.get_elapsed_ticks();
+    uint_fast8_t idx = VFD_N_POLLS;
+    vfd_poll_t *poll = NULL;
+
+    do {
+        if(polls[--idx].context != VFD_Idle && ms - polls[idx].sent >= VFD_POLL_TIMEOUT)
+            polls[idx].context = VFD_Idle; // response lost, e.g. queue flushed on reset
+        if(polls[idx].context == (vfd_response_t)msg->context && polls[idx].address == (uint8_t)msg->adu[0])
+            return false;
+        if(polls[idx].context == VFD_Idle)
+            poll = &polls[idx];
+    } while(idx);
+
+    if(poll == NULL)
+        return false;
+
+    vfd_response_t poll_context = (vfd_response_t)msg->context;
+
+    poll->context = poll_context;
+    poll->address = (uint8_t)msg->adu[0];
+    poll->sent = ms;
+    poll->callbacks = callbacks;
+
+    // The message is copied when queued, the context is only replaced for the queued copy.
+    msg->context = (void *)poll;
+
+    if(!modbus_send(msg, &poll_callbacks, false))
+        poll->context = VFD_Idle;
+
+    msg->context = (void *)poll_context;
+
+    return poll->context != VFD_Idle;
+}
+
+/*! \brief Check if a telemetry item is due in the current status poll cycle.
+
+Intended for drivers that poll slowly changing data such as output current in separate frames.
+\param decimation poll the item every decimation cycle, 0 or 1 for every cycle.
+\returns true if the item is to be polled.
+*/
+bool vfd_poll_due (uint_fast16_t decimation)
+{
+    return decimation <= 1 || vfd_query == NULL || vfd_query->query.cycle % decimation == 0;
+}
+
 #ifdef GRBL_ESP32
 static void esp32_spindle_off (spindle_ptrs_t *spindle)
 {
@@ -92,6 +222,7 @@ static void esp32_spindle_off (spindle_ptrs_t *spindle)
 }
 #endif
 
+// The descriptor is referenced, not copied, and must be in static storage.
 spindle_id_t vfd_register (const vfd_spindle_ptrs_t *vfd, const char *name)
 {
     spindle_id_t spindle_id = -1;
@@ -99,7 +230,8 @@ spindle_id_t vfd_register (const vfd_spindle_ptrs_t *vfd, const char *name)
     if(n_spindle < N_SPINDLE && (spindle_id = spindle_register(&vfd->spindle, name)) != -1) {
 
         vfd_spindles[n_spindle].id = spindle_id;
-        memcpy(&vfd_spindles[n_spindle++].hal, vfd, sizeof(vfd_spindle_ptrs_t));
+        vfd_spindles[n_spindle].query.interval = VFD_QUERY_INTERVAL_RAMP;
+        vfd_spindles[n_spindle++].hal = vfd;
 #ifdef GRBL_ESP32
         spindle_get_hal(spindle_id, SpindleHAL_Configured)->esp32_off = esp32_spindle_off;
 #endif
@@ -266,6 +398,10 @@ PROGMEM static const setting_detail_t vfd_settings[] = {
      { Setting_VFD_17, Group_VFD, "RPM input Divider", "", Format_Decimal, "########0", NULL, NULL, Setting_NonCore, &vfd_config.in_divider, NULL, is_modvfd_selected },
      { Setting_VFD_18, Group_VFD, "RPM output Multiplier", "", Format_Decimal, "########0", NULL, NULL, Setting_NonCore, &vfd_config.out_multiplier, NULL, is_modvfd_selected },
      { Setting_VFD_19, Group_VFD, "RPM output Divider", "", Format_Decimal, "########0", NULL, NULL, Setting_NonCore, &vfd_config.out_divider, NULL, is_modvfd_selected },
+     { Setting_MODVFD_Options, Group_VFD, "MODVFD options", NULL, Format_Bitfield, "Read input registers,Write multiple registers,Combined run and frequency write,Read current with frequency,Combined frequency write and status read", NULL, NULL, Setting_NonCore, &modvfd_config.options.mask, NULL, is_modvfd_selected },
+     { Setting_MODVFD_AmpsReg, Group_VFD, "Get Current Register (decimal)", NULL, Format_Int16, "####0", NULL, "65535", Setting_NonCore, &modvfd_config.amps_reg, NULL, is_modvfd_selected },
+     { Setting_MODVFD_MaxAmpsReg, Group_VFD, "Get Max Current Register (decimal)", NULL, Format_Int16, "####0", NULL, "65535", Setting_NonCore, &modvfd_config.max_amps_reg, NULL, is_modvfd_selected },
+     { Setting_MODVFD_AmpsDivider, Group_VFD, "Current Divider", NULL, Format_Int16, "####0", "1", "65535", Setting_NonCore, &modvfd_config.amps_divider, NULL, is_modvfd_selected },
 #endif
 };
 
@@ -296,12 +432,43 @@ PROGMEM static const setting_descr_t vfd_settings_descr[] = {
     { Setting_VFD_17, "MODVFD RPM value divider for programming RPM" },
     { Setting_VFD_18, "MODVFD RPM value multiplier for reading RPM" },
     { Setting_VFD_19, "MODVFD RPM value divider for reading RPM" },
+    { Setting_MODVFD_Options, "MODVFD ModBus function code selection and frame combining.\\n"
+                              "\"Combined run and frequency write\" requires the set frequency register to follow the run/stop register.\\n"
+                              "\"Read current with frequency\" requires the get current register to be close to the get frequency register.\\n"
+                              "\"Combined frequency write and status read\" uses function 0x17, reverts to separate frames if the drive does not support it."
+    },
+    { Setting_MODVFD_AmpsReg, "MODVFD Get Output Current Register, set to 0 to disable load reporting." },
+    { Setting_MODVFD_MaxAmpsReg, "MODVFD Get Max (rated) Current Register, set to 0 to disable load reporting." },
+    { Setting_MODVFD_AmpsDivider, "MODVFD divider for converting the output current value to the unit of the max current value." },
 #endif
 };
 
+static void vfd_scaling_update (void)
+{
+    vfd_scaling.rpm2f = vfd_q16_factor(vfd_config.in_multiplier, vfd_config.in_divider);
+    vfd_scaling.f2rpm = vfd_q16_factor(vfd_config.out_multiplier, vfd_config.out_divider);
+    vfd_scaling.rpm2f_cHz = vfd_q16_factor(100.0f, (float)vfd_config.vfd_rpm_hz);
+    vfd_scaling.f2rpm_cHz = vfd_q16_factor((float)vfd_config.vfd_rpm_hz, 100.0f);
+    vfd_scaling.rpm2f_dHz = vfd_q16_factor(10.0f, (float)vfd_config.vfd_rpm_hz);
+    vfd_scaling.f2rpm_dHz = vfd_q16_factor((float)vfd_config.vfd_rpm_hz, 10.0f);
+}
+
 static void vfd_settings_save (void)
 {
+    vfd_scaling_update();
+
     hal.nvs.memcpy_to_nvs(nvs_address, (uint8_t *)&vfd_config, sizeof(vfd_settings_t), true);
+    hal.nvs.memcpy_to_nvs(modvfd_nvs_address, (uint8_t *)&modvfd_config, sizeof(modvfd_settings_t), true);
+}
+
+static void modvfd_settings_restore (void)
+{
+    modvfd_config.options.mask = 0;
+    modvfd_config.amps_reg = 0;
+    modvfd_config.max_amps_reg = 0;
+    modvfd_config.amps_divider = 1;
+
+    hal.nvs.memcpy_to_nvs(modvfd_nvs_address, (uint8_t *)&modvfd_config, sizeof(modvfd_settings_t), true);
 }
 
 static void vfd_settings_restore (void)
@@ -328,13 +495,22 @@ static void vfd_settings_restore (void)
     vfd_config.out_multiplier = 60;
     vfd_config.out_divider = 100;
 
+    vfd_scaling_update();
+
     hal.nvs.memcpy_to_nvs(nvs_address, (uint8_t *)&vfd_config, sizeof(vfd_settings_t), true);
+
+    modvfd_settings_restore();
 }
 
 static void vfd_settings_load (void)
 {
     if((hal.nvs.memcpy_from_nvs((uint8_t *)&vfd_config, nvs_address, sizeof(vfd_settings_t), true) != NVS_TransferResult_OK))
         vfd_settings_restore();
+    else {
+        vfd_scaling_update();
+        if((hal.nvs.memcpy_from_nvs((uint8_t *)&modvfd_config, modvfd_nvs_address, sizeof(modvfd_settings_t), true) != NVS_TransferResult_OK))
+            modvfd_settings_restore();
+    }
 }
 
 static vfd_spindle_t *get_spindle (spindle_id_t spindle_id)
@@ -351,51 +527,131 @@ static vfd_spindle_t *get_spindle (spindle_id_t spindle_id)
     return spindle;
 }
 
+// Returns the status poll interval for the current state.
+// Polls fast while the spindle is changing speed so at speed is detected quickly, including spin down
+// after a stop, slow when at speed and nearly not at all when stopped.
+static uint32_t query_interval (vfd_spindle_t *vfd, spindle_ptrs_t *spindle, spindle_state_t state)
+{
+    if(state.on)
+        return state.at_speed || spindle->at_speed_tolerance <= 0.0f ? VFD_QUERY_INTERVAL_RUN : VFD_QUERY_INTERVAL_RAMP;
+
+    return vfd->hal->spindle.get_data && vfd->hal->spindle.get_data(SpindleData_RPM)->rpm > 0.0f
+            ? VFD_QUERY_INTERVAL_RAMP
+            : VFD_QUERY_INTERVAL_IDLE;
+}
+
 // Returns spindle state in a spindle_state_t variable.
-// Caps request interval to once every VFD_QUERY_INTERVAL ms max (default 150).
+// Request interval depends on the spindle state, see query_interval().
 static spindle_state_t vfd_get_state (spindle_ptrs_t *spindle)
 {
-    static uint32_t last_request;
-    static spindle_state_t state = (spindle_state_t){0};
+    vfd_spindle_t *vfd;
+
+    if((vfd = get_spindle(spindle->id)) == NULL)
+        return (spindle_state_t){0};
 
     uint32_t ms = hal.get_elapsed_ticks();
 
-    if((ms = hal.get_elapsed_ticks()) - last_request >= VFD_QUERY_INTERVAL) {
-        state = vfd_spindle.hal.spindle.get_state(spindle);
-        last_request = ms;
+    if(ms - vfd->query.last_request >= vfd->query.interval) {
+        vfd->query.cycle++;
+        vfd_query = vfd;
+        vfd->query.state = vfd->hal->spindle.get_state(spindle);
+        vfd_query = NULL;
+        vfd->query.last_request = ms;
+        vfd->query.interval = query_interval(vfd, spindle, vfd->query.state);
     }
 
-    return state;
+    return vfd->query.state;
+}
+
+// A new target is programmed, switch to fast polling until it is reached.
+static void vfd_set_state (spindle_ptrs_t *spindle, spindle_state_t state, float rpm)
+{
+    vfd_spindle_t *vfd;
+
+    if((vfd = get_spindle(spindle->id))) {
+        vfd->hal->spindle.set_state(spindle, state, rpm);
+        vfd->query.interval = VFD_QUERY_INTERVAL_RAMP;
+    }
+}
+
+static void vfd_update_rpm (spindle_ptrs_t *spindle, float rpm)
+{
+    vfd_spindle_t *vfd;
+
+    if((vfd = get_spindle(spindle->id))) {
+        vfd->hal->spindle.update_rpm(spindle, rpm);
+        vfd->query.interval = VFD_QUERY_INTERVAL_RAMP;
+    }
 }
 
 static bool vfd_spindle_select (spindle_ptrs_t *spindle)
 {
     bool ok = on_spindle_select == NULL || on_spindle_select(spindle);
+    vfd_spindle_t *vfd;
 
-    if(ok && get_spindle(spindle->id))
+    if(ok && (vfd = get_spindle(spindle->id))) {
         spindle->get_state = vfd_get_state;
+        spindle->set_state = vfd_set_state;
+        if(vfd->hal->spindle.update_rpm)
+            spindle->update_rpm = vfd_update_rpm;
+    }
 
     return ok;
 }
 
 static void vfd_spindle_selected (spindle_ptrs_t *spindle)
 {
-    vfd_spindle_t *vfd;
+    if(vfd_spindle && vfd_spindle->id != spindle->id && vfd_spindle->hal->vfd.on_selected)
+        vfd_spindle->hal->vfd.on_selected(NULL);
 
     spindle_changed = true;
-    vfd_spindle.id = -1;
-    memset(&vfd_spindle.hal, 0, sizeof(vfd_spindle_ptrs_t));
 
-    if((vfd = get_spindle(spindle->id))) {
+    if((vfd_spindle = get_spindle(spindle->id))) {
         modbus_flush_queue();
-        vfd_spindle.id = spindle->id;
-        memcpy(&vfd_spindle.hal, &vfd->hal, sizeof(vfd_spindle_ptrs_t));
+        memset(polls, 0, sizeof(polls));
+        vfd_spindle->query.interval = VFD_QUERY_INTERVAL_RAMP;
+        if(vfd_spindle->hal->vfd.on_selected)
+            vfd_spindle->hal->vfd.on_selected(spindle);
     };
 
     if(on_spindle_selected)
         on_spindle_selected(spindle);
 }
 
+static void vfd_settings_changed (settings_t *settings, settings_changed_flags_t changed)
+{
+    uint_fast8_t idx = n_spindle;
+
+    settings_changed(settings, changed);
+
+    if(n_spindle) do {
+        if(vfd_spindles[--idx].hal->vfd.settings_changed)
+            vfd_spindles[idx].hal->vfd.settings_changed(settings, changed);
+    } while(idx);
+}
+
+static void vfd_report_options (bool newopt)
+{
+    uint_fast8_t idx;
+
+    on_report_options(newopt);
+
+    if(!newopt) {
+        for(idx = 0; idx < n_spindle; idx++) {
+            if(vfd_spindles[idx].hal->vfd.report_options)
+                vfd_spindles[idx].hal->vfd.report_options();
+        }
+    }
+}
+
+static void vfd_driver_reset (void)
+{
+    driver_reset();
+
+    if(vfd_spindle && vfd_spindle->hal->vfd.on_reset)
+        vfd_spindle->hal->vfd.on_reset();
+}
+
 static void raise_alarm (void *data)
 {
     system_raise_alarm(Alarm_ModbusException);
@@ -420,7 +676,7 @@ bool vfd_failed (bool disable)
 
 const vfd_ptrs_t *vfd_get_active (void)
 {
-    return vfd_spindle.id == -1 ? NULL : &vfd_spindle.hal.vfd;
+    return vfd_spindle ? &vfd_spindle->hal->vfd : NULL;
 }
 
 float vfd_atspeed_configure (spindle_ptrs_t *spindle, spindle_data_t *spindle_data)
@@ -433,6 +689,15 @@ float vfd_atspeed_configure (spindle_ptrs_t *spindle, spindle_data_t *spindle_da
     return settings.spindle.at_speed_tolerance;
 }
 
+// Returns round(multiplier / divider * 2^16), 0 if the divider is 0 or the factor is out of range.
+// Only to be called when settings or drive parameters changes, not from ModBus callbacks.
+vfd_q16_t vfd_q16_factor (float multiplier, float divider)
+{
+    double factor = divider == 0.0f ? 0.0 : (double)multiplier * (double)VFD_Q16_ONE / (double)divider;
+
+    return factor <= 0.0 || factor >= 4294967295.0 ? 0 : (vfd_q16_t)(factor + 0.5);
+}
+
 void vfd_init (void)
 {
     static setting_details_t vfd_setting_details = {
@@ -447,7 +712,8 @@ void vfd_init (void)
         .save = vfd_settings_save
     };
 
-    if(modbus_enabled() && (nvs_address = nvs_alloc(sizeof(vfd_settings_t)))) {
+    if(modbus_enabled() && (nvs_address = nvs_alloc(sizeof(vfd_settings_t))) &&
+        (modvfd_nvs_address = nvs_alloc(sizeof(modvfd_settings_t)))) {
 
         settings_register(&vfd_setting_details);
 
@@ -491,6 +757,18 @@ void vfd_init (void)
 
         on_spindle_selected = grbl.on_spindle_selected;
         grbl.on_spindle_selected = vfd_spindle_selected;
+
+        if(n_spindle) {
+
+            settings_changed = hal.settings_changed;
+            hal.settings_changed = vfd_settings_changed;
+
+            on_report_options = grbl.on_report_options;
+            grbl.on_report_options = vfd_report_options;
+
+            driver_reset = hal.driver_reset;
+            hal.driver_reset = vfd_driver_reset;
+        }
     }
 }
 
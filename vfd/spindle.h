@@ -33,6 +33,7 @@
 #include "grbl/task.h"
 
 #include "spindle/shared.h"
+#include "runstop.h"
 
 #ifndef VFD_RETRIES
 #define VFD_RETRIES     5
@@ -40,11 +41,22 @@
 #ifndef VFD_RETRY_DELAY
 #define VFD_RETRY_DELAY 100
 #endif
+#ifndef VFD_AMPS_DECIMATION
+#define VFD_AMPS_DECIMATION 4 // Output current is polled every Nth status poll cycle
+#endif
 #ifndef VFD_ASYNC_EXCEPTION_LEVEL
 #define VFD_ASYNC_EXCEPTION_LEVEL 10
 #endif
 #define VFD_N_ADRESSES  4
 
+#define MODVFD_MAX_POLL_REGS ((MODBUS_MAX_ADU_SIZE - 5) / 2)
+#define MODVFD_ReadWriteRegisters 0x17 // ModBus function code, not defined by the core
+
+#define VFD_Q16_ONE (1UL << 16)
+
+// Unsigned Q16.16 fixed point scaling factor, see vfd_q16_factor().
+typedef uint32_t vfd_q16_t;
+
 typedef enum {
     VFD_Idle = 0,
     VFD_GetRPM,
@@ -65,6 +77,18 @@ typedef enum {
     VFD_Ready,
 } vfd_state_t;
 
+typedef union {
+    uint8_t mask;
+    struct {
+        uint8_t read_input_regs :1, // Use ReadInputRegisters (0x04) instead of ReadHoldingRegisters (0x03)
+                write_multiple  :1, // Use WriteRegisters (0x10) instead of WriteRegister (0x06)
+                combined_write  :1, // Write run/stop and frequency in one frame, requires adjacent registers
+                poll_amps       :1, // Read output current in the same frame as frequency if registers are close
+                read_write      :1, // Use Read/Write Multiple Registers (0x17) for frequency write and status read
+                unused          :3;
+    };
+} modvfd_options_t;
+
 typedef struct {
 #if N_SPINDLE > 1 || N_SYS_SPINDLE > 1
     uint8_t modbus_address[VFD_N_ADRESSES];
@@ -84,6 +108,14 @@ typedef struct {
     float out_divider;
 } vfd_settings_t;
 
+// MODVFD extended settings, stored in a separate NVS block so that vfd_settings_t is kept when upgrading.
+typedef struct {
+    modvfd_options_t options;
+    uint16_t amps_reg;
+    uint16_t max_amps_reg;
+    uint16_t amps_divider;
+} modvfd_settings_t;
+
 typedef struct {
     uint8_t modbus_address;
     struct {
@@ -102,10 +134,29 @@ typedef struct {
     float out_factor;
 } vfd_config_t;
 
+// Q16.16 scaling factors derived from vfd_settings_t, updated on settings load and change.
+typedef struct {
+    vfd_q16_t rpm2f;        // MODVFD programmed RPM to set frequency register value
+    vfd_q16_t f2rpm;        // MODVFD get frequency register value to RPM
+    vfd_q16_t rpm2f_cHz;    // RPM to 0.01 Hz from RPM per Hz setting
+    vfd_q16_t f2rpm_cHz;    // 0.01 Hz to RPM from RPM per Hz setting
+    vfd_q16_t rpm2f_dHz;    // RPM to 0.1 Hz from RPM per Hz setting
+    vfd_q16_t f2rpm_dHz;    // 0.1 Hz to RPM from RPM per Hz setting
+} vfd_scaling_t;
+
 typedef float (*vfd_get_load_ptr)(void);
+typedef void (*vfd_on_selected_ptr)(spindle_ptrs_t *spindle);
+typedef void (*vfd_settings_changed_ptr)(settings_t *settings, settings_changed_flags_t changed);
+typedef void (*vfd_report_options_ptr)(void);
+typedef void (*vfd_on_reset_ptr)(void);
 
+// Event handlers are dispatched by the VFD layer, drivers should not hook the core events themselves.
 typedef struct {
     vfd_get_load_ptr get_load;
+    vfd_on_selected_ptr on_selected;            //!< Called with the spindle when selected, with NULL when deselected.
+    vfd_settings_changed_ptr settings_changed;  //!< Called for all registered VFD spindles.
+    vfd_report_options_ptr report_options;      //!< Called for all registered VFD spindles, should report plugin name and version.
+    vfd_on_reset_ptr on_reset;                  //!< Called for the selected VFD spindle on a driver reset.
 } vfd_ptrs_t;
 
 typedef struct {
@@ -114,11 +165,34 @@ typedef struct {
 } vfd_spindle_ptrs_t;
 
 extern vfd_settings_t vfd_config;
+extern modvfd_settings_t modvfd_config;
+extern vfd_scaling_t vfd_scaling;
+
+/*! \brief Scale a value by a Q16.16 factor, result is rounded half up.
+
+With factor = round(m / d * 2^16) the factor error is <= 0.5 * 2^-16, the result error vs. the exact
+value * m / d is thus <= 0.5 + value * 2^-17, i.e. <= 1 for any 16-bit ModBus register value.
+Integer only, intended for use in ModBus callbacks.
+*/
+static inline uint32_t vfd_q16_scale (uint32_t value, vfd_q16_t factor)
+{
+    return (uint32_t)(((uint64_t)value * factor + (VFD_Q16_ONE >> 1)) >> 16);
+}
+
+//! Converts a programmed RPM to an unsigned integer, rounded to nearest. Negative values returns 0.
+static inline uint32_t vfd_rpm_to_uint (float rpm)
+{
+    return rpm > 0.0f ? (uint32_t)(rpm + 0.5f) : 0;
+}
+
 
 spindle_id_t vfd_register (const vfd_spindle_ptrs_t *vfd, const char *name);
 const vfd_ptrs_t *vfd_get_active (void);
+bool vfd_poll (modbus_message_t *msg, const modbus_callbacks_t *callbacks);
+bool vfd_poll_due (uint_fast16_t decimation);
 bool vfd_failed (bool disable);
 uint32_t vfd_get_modbus_address (spindle_id_t spindle_id);
 float vfd_atspeed_configure (spindle_ptrs_t *spindle, spindle_data_t *spindle_data);
+vfd_q16_t vfd_q16_factor (float multiplier, float divider);
 
 #endif
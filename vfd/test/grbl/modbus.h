@@ -0,0 +1,47 @@
+/*
+
+  vfd/test/grbl/modbus.h - minimal ModBus API for host side tests
+
+  Part of grblHAL
+
+  Copyright (c) 2026 Terje Io
+
+  grblHAL is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  grblHAL is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with grblHAL. If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef _MODBUS_H_
+#define _MODBUS_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+typedef struct {
+    void *context;
+    uint8_t tx_length;
+    uint8_t rx_length;
+    bool crc_check;
+    char adu[32];
+} modbus_message_t;
+
+typedef struct {
+    uint8_t retries;
+    uint16_t retry_delay;
+    void (*on_rx_packet)(modbus_message_t *msg);
+    void (*on_rx_exception)(uint8_t code, void *context);
+} modbus_callbacks_t;
+
+bool modbus_send (modbus_message_t *msg, const modbus_callbacks_t *callbacks, bool block);
+
+#endif
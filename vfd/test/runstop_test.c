@@ -0,0 +1,98 @@
+/*
+
+  vfd/test/runstop_test.c - host side test of the VFD run/stop and frequency command order
+
+  Part of grblHAL
+
+  Copyright (c) 2026 Terje Io
+
+  grblHAL is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  grblHAL is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with grblHAL. If not, see <http://www.gnu.org/licenses/>.
+
+  Build and run from the spindle plugin directory:
+
+    cc -I vfd/test -o runstop_test vfd/test/runstop_test.c && ./runstop_test
+
+*/
+
+#include <stdio.h>
+#include <string.h>
+
+#include "../runstop.h"
+
+typedef enum {
+    Frame_None = 0,
+    Frame_SetRPM,
+    Frame_RunStop
+} frame_t;
+
+static frame_t sent[4];
+static uint_fast8_t n_sent;
+static bool rpm_ok, runstop_ok;
+static int failed = 0;
+
+bool modbus_send (modbus_message_t *msg, const modbus_callbacks_t *callbacks, bool block)
+{
+    (void)msg;
+    (void)callbacks;
+
+    if(!block)
+        failed++, printf("FAIL: run/stop command sent non-blocking\n");
+
+    sent[n_sent++] = Frame_RunStop;
+
+    return runstop_ok;
+}
+
+static bool set_rpm (float rpm, bool block)
+{
+    (void)rpm;
+
+    if(!block)
+        failed++, printf("FAIL: frequency sent non-blocking\n");
+
+    sent[n_sent++] = Frame_SetRPM;
+
+    return rpm_ok;
+}
+
+static void check (const char *name, bool on, bool rpm_result, bool runstop_result, bool expected, frame_t first, frame_t second)
+{
+    static const modbus_callbacks_t callbacks = {0};
+    modbus_message_t runstop = {0};
+    bool ok;
+
+    memset(sent, 0, sizeof(sent));
+    n_sent = 0;
+    rpm_ok = rpm_result;
+    runstop_ok = runstop_result;
+
+    ok = vfd_send_runstop(on, 1000.0f, &runstop, &callbacks, set_rpm);
+
+    if(ok != expected || sent[0] != first || sent[1] != second || sent[2] != Frame_None) {
+        failed++;
+        printf("FAIL: %s\n", name);
+    } else
+        printf("ok: %s\n", name);
+}
+
+int main (void)
+{
+    check("start sends frequency before run", true, true, true, true, Frame_SetRPM, Frame_RunStop);
+    check("start does not run if frequency write fails", true, false, true, false, Frame_SetRPM, Frame_None);
+    check("start reports failed run command", true, true, false, false, Frame_SetRPM, Frame_RunStop);
+    check("stop sends stop before frequency", false, true, true, true, Frame_RunStop, Frame_SetRPM);
+    check("stop does not write frequency if stop fails", false, true, false, false, Frame_RunStop, Frame_None);
+
+    return failed ? 1 : 0;
+}
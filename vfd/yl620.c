@@ -84,9 +84,6 @@ static spindle_state_t spindle_state = {0};
 static spindle_data_t spindle_data = {0};
 static vfd_state_t vfd_state;
 
-static on_report_options_ptr on_report_options;
-static on_spindle_selected_ptr on_spindle_selected;
-static settings_changed_ptr settings_changed;
 
 static void rx_packet (modbus_message_t *msg);
 static void rx_exception (uint8_t code, void *context);
@@ -98,6 +95,19 @@ static const modbus_callbacks_t callbacks = {
     .on_rx_exception = rx_exception
 };
 
+// Status poll frame, address is set when the spindle is selected. Written to when sent, see vfd_poll().
+static modbus_message_t poll_cmd = {
+    .context = (void *)VFD_GetRPM,
+    .crc_check = false,
+    .adu[1] = ModBus_ReadHoldingRegisters,
+    .adu[2] = 0x20,
+    .adu[3] = 0x0B,
+    .adu[4] = 0x00,
+    .adu[5] = 0x01,
+    .tx_length = 8,
+    .rx_length = 7
+};
+
 // TODO: this should be a mechanism to read max RPM from the VFD in order to configure RPM/Hz instead of above define.
 
 static bool spindleConfig (spindle_ptrs_t *spindle)
@@ -105,14 +115,15 @@ static bool spindleConfig (spindle_ptrs_t *spindle)
     return modbus_isup().rtu;
 }
 
-static void set_rpm (float rpm, bool block)
+static bool set_rpm (float rpm, bool block)
 {
     static uint8_t busy = 0;
 
     if(busy && !block)
-        return;
+        return false;
 
-    uint16_t data = ((uint32_t)(rpm) * 10) / vfd_config.vfd_rpm_hz;
+    bool ok;
+    uint16_t data = vfd_q16_scale(vfd_rpm_to_uint(rpm), vfd_scaling.rpm2f_dHz);
 
     modbus_message_t rpm_cmd = {
         .context = (void *)VFD_SetRPM,
@@ -128,9 +139,11 @@ static void set_rpm (float rpm, bool block)
     };
 
     busy++;
-    modbus_send(&rpm_cmd, &callbacks, block);
+    ok = modbus_send(&rpm_cmd, &callbacks, block);
     spindle_set_at_speed_range(spindle_hal, &spindle_data, rpm);
     busy--;
+
+    return ok;
 }
 
 static void spindleUpdateRPM (spindle_ptrs_t *spindle, float rpm)
@@ -174,8 +187,7 @@ static void spindleSetState (spindle_ptrs_t *spindle, spindle_state_t state, flo
     spindle_state.on = spindle_data.state_programmed.on = state.on;
     spindle_state.ccw = spindle_data.state_programmed.ccw = state.ccw;
 
-    if(modbus_send(&mode_cmd, &callbacks, true))
-        set_rpm(rpm, true);
+    vfd_send_runstop(state.on && rpm != 0.0f, rpm, &mode_cmd, &callbacks, set_rpm);
 
     busy = false;
 }
@@ -193,20 +205,7 @@ static spindle_state_t spindleGetState (spindle_ptrs_t *spindle)
     if(vfd_state != VFD_Ready)
         return spindle_state;
 
-    modbus_message_t mode_cmd = {
-        .context = (void *)VFD_GetRPM,
-        .crc_check = false,
-        .adu[0] = modbus_address,
-        .adu[1] = ModBus_ReadHoldingRegisters,
-        .adu[2] = 0x20,
-        .adu[3] = 0x0B,
-        .adu[4] = 0x00,
-        .adu[5] = 0x01,
-        .tx_length = 8,
-        .rx_length = 7
-    };
-
-    modbus_send(&mode_cmd, &callbacks, false); // TODO: add flag for not raising alarm?
+    vfd_poll(&poll_cmd, &callbacks);
 
     spindle_state.at_speed = spindle->get_data(SpindleData_AtSpeed)->state_programmed.at_speed;
 
@@ -225,7 +224,7 @@ static void rx_packet (modbus_message_t *msg)
 
             case VFD_GetRPM:
                 exceptions = 0;
-                spindle_validate_at_speed(spindle_data, (float)(((msg->adu[3] << 8) | msg->adu[4]) * vfd_config.vfd_rpm_hz / 10));
+                spindle_validate_at_speed(spindle_data, (float)vfd_q16_scale((msg->adu[3] << 8) | msg->adu[4], vfd_scaling.f2rpm_dHz));
                 break;
 
             default:
@@ -242,37 +241,30 @@ static void rx_exception (uint8_t code, void *context)
     }
 }
 
-static void onReportOptions (bool newopt)
+static void onReportOptions (void)
 {
-    on_report_options(newopt);
-
-    if(!newopt)
-        report_plugin("Yalang VFD YL620A", "0.08");
+    report_plugin("Yalang VFD YL620A", "0.09");
 }
 
 static void onSpindleSelected (spindle_ptrs_t *spindle)
 {
-    if(spindle->id == spindle_id) {
+    if(spindle) {
 
         spindle_data.rpm_programmed = -1.0f;
         vfd_atspeed_configure((spindle_hal = spindle), &spindle_data);
 
         modbus_set_silence(NULL);
         modbus_address = vfd_get_modbus_address(spindle_id);
+        poll_cmd.adu[0] = modbus_address;
 
 //        spindleGetMaxRPM();
 
     } else
         spindle_hal = NULL;
-
-    if(on_spindle_selected)
-        on_spindle_selected(spindle);
 }
 
 static void settingsChanged (settings_t *settings, settings_changed_flags_t changed)
 {
-    settings_changed(settings, changed);
-
     if(changed.spindle)
         spindle_get_hal(spindle_id, SpindleHAL_Configured)->at_speed_tolerance = vfd_atspeed_configure(spindle_hal, &spindle_data);
 }
@@ -293,21 +285,16 @@ void vfd_yl620_init (void)
             .set_state = spindleSetState,
             .get_state = spindleGetState,
             .update_rpm = spindleUpdateRPM,
-            .get_data = spindleGetData,
+            .get_data = spindleGetData
+        },
+        .vfd = {
+            .on_selected = onSpindleSelected,
+            .settings_changed = settingsChanged,
+            .report_options = onReportOptions
         }
     };
 
-    if((spindle_id = vfd_register(&vfd, "Yalang YS620")) != -1) {
-
-        on_spindle_selected = grbl.on_spindle_selected;
-        grbl.on_spindle_selected = onSpindleSelected;
-
-        settings_changed = hal.settings_changed;
-        hal.settings_changed = settingsChanged;
-
-        on_report_options = grbl.on_report_options;
-        grbl.on_report_options = onReportOptions;
-    }
+    spindle_id = vfd_register(&vfd, "Yalang YS620");
 }
 
 #endif